@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <pico/stdlib.h>
+#include <hardware/pwm.h>
+#include <hardware/sync.h>
+#include <hardware/timer.h>
+#ifdef AUDIO_WAVETABLE
+#include <hardware/dma.h>
+#include <hardware/clocks.h>
+#endif
+#ifdef KEYBOARD_BENCHMARK
+#include <hardware/structs/systick.h>
+#endif
+
+#include "audio.h"
+
+// Two voices share the buzzer, the bell wins over a click while both sound.
+#define AUDIO_VOICES    (2)
+
+#ifdef AUDIO_WAVETABLE
+// Samples per table, the DMA read ring wraps on a 256 byte boundary
+#define AUDIO_SAMPLES   (64)
+#define AUDIO_RATE      (32000)
+#endif
+
+typedef struct audio_voice_s {
+    uint64_t end;       // us since boot, 0 when silent
+    uint8_t volume;     // 0-7
+} audio_voice_t;
+
+static audio_voice_t voices[AUDIO_VOICES];
+static spin_lock_t *audio_lock;
+static uint audio_alarm;
+static uint audio_slice;
+static uint audio_chan;
+static int audio_playing = -1;
+static volatile bool audio_ready;   // Set by audio_init() once the above are valid
+
+uint32_t audio_requests;            // Click and bell requests
+#ifdef KEYBOARD_BENCHMARK
+uint32_t audio_play_cycles_max;     // Worst audio_play() on core1, SysTick cycles
+#endif
+
+#ifdef AUDIO_WAVETABLE
+static const int8_t audio_sine[AUDIO_SAMPLES] = {
+       0,   12,   25,   37,   49,   60,   71,   81,   90,   98,  106,  112,  117,  122,  125,  126,
+     127,  126,  125,  122,  117,  112,  106,   98,   90,   81,   71,   60,   49,   37,   25,   12,
+       0,  -12,  -25,  -37,  -49,  -60,  -71,  -81,  -90,  -98, -106, -112, -117, -122, -125, -126,
+    -127, -126, -125, -122, -117, -112, -106,  -98,  -90,  -81,  -71,  -60,  -49,  -37,  -25,  -12,
+};
+
+static uint32_t audio_wave[AUDIO_SAMPLES] __attribute__((aligned(AUDIO_SAMPLES * 4)));
+static uint audio_dma;
+
+// Bell is one 500Hz sine cycle per table, click four 2kHz square cycles.
+static void audio_output(int voice, uint8_t volume) {
+    int i, s;
+
+    dma_channel_abort(audio_dma);
+
+    if(voice < 0) {
+        pwm_set_chan_level(audio_slice, audio_chan, 0);
+        return;
+    }
+
+    for(i = 0; i < AUDIO_SAMPLES; i++) {
+        if(voice == AUDIO_BELL)
+            s = audio_sine[i];
+        else
+            s = (i & 8) ? -127 : 127;
+        audio_wave[i] = (128 + ((s * volume) / 8)) << (audio_chan ? 16 : 0);
+    }
+
+    dma_channel_set_read_addr(audio_dma, audio_wave, true);
+}
+#else
+// Square wave at 2kHz, louder voices get a wider pulse
+static void audio_output(int voice, uint8_t volume) {
+    pwm_set_chan_level(audio_slice, audio_chan, (voice < 0) ? 0 : volume * 36);
+}
+#endif
+
+// Expire finished voices and sound the one with priority, lock held
+static void audio_update(uint64_t now) {
+    int i, voice = -1;
+
+    for(i = 0; i < AUDIO_VOICES; i++) {
+        if(voices[i].end && (voices[i].end <= now))
+            voices[i].end = 0;
+        if(voices[i].end)
+            voice = i;
+    }
+
+    if(voice != audio_playing) {
+        audio_output(voice, (voice < 0) ? 0 : voices[voice].volume);
+        audio_playing = voice;
+    }
+}
+
+// Keep the alarm on the earliest end of any sounding voice, lock held
+static void audio_arm() {
+    uint64_t end;
+    int i;
+
+    do {
+        end = 0;
+        for(i = 0; i < AUDIO_VOICES; i++)
+            if(voices[i].end && (!end || (voices[i].end < end)))
+                end = voices[i].end;
+
+        if(!end)
+            return;
+
+        if(!hardware_alarm_set_target(audio_alarm, from_us_since_boot(end)))
+            return;
+
+        // Already due, expire it here instead
+        audio_update(time_us_64());
+    } while(1);
+}
+
+static void audio_alarm_callback(uint alarm) {
+    uint32_t save = spin_lock_blocking(audio_lock);
+
+    audio_update(time_us_64());
+    audio_arm();
+    spin_unlock(audio_lock, save);
+}
+
+// Safe from either core, overlapping requests extend the voice. Requests
+// before audio_init() has finished are dropped.
+void audio_play(uint voice, uint8_t volume, uint32_t duration_us) {
+    uint64_t now, end;
+    uint32_t save;
+#ifdef KEYBOARD_BENCHMARK
+    uint32_t start = systick_hw->cvr;
+#endif
+
+    if(!volume || (voice >= AUDIO_VOICES) || !audio_ready)
+        return;
+    __dmb();
+
+    save = spin_lock_blocking(audio_lock);
+    audio_requests++;
+
+    now = time_us_64();
+    end = now + duration_us;
+    if(end > voices[voice].end)
+        voices[voice].end = end;
+    voices[voice].volume = volume;
+
+    // Force the new volume out if this voice is already the one playing
+    if(audio_playing == (int) voice)
+        audio_playing = AUDIO_VOICES;
+
+    audio_update(now);
+    audio_arm();
+    spin_unlock(audio_lock, save);
+
+#ifdef KEYBOARD_BENCHMARK
+    start = (start - systick_hw->cvr) & 0xFFFFFF;
+    if((get_core_num() == 1) && (start > audio_play_cycles_max))
+        audio_play_cycles_max = start;
+#endif
+}
+
+void audio_silence() {
+    uint32_t save;
+    int i;
+
+    if(!audio_ready)
+        return;
+    __dmb();
+
+    save = spin_lock_blocking(audio_lock);
+    hardware_alarm_cancel(audio_alarm);
+    for(i = 0; i < AUDIO_VOICES; i++)
+        voices[i].end = 0;
+    audio_update(time_us_64());
+    spin_unlock(audio_lock, save);
+}
+
+void audio_init(uint gpio) {
+    pwm_config pwmcfg;
+#ifdef AUDIO_WAVETABLE
+    dma_channel_config dmacfg;
+    int timer;
+#endif
+
+    audio_lock = spin_lock_instance(spin_lock_claim_unused(true));
+
+    // Voices end from one hardware alarm, serviced on this core
+    audio_alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(audio_alarm, audio_alarm_callback);
+
+    gpio_set_function(gpio, GPIO_FUNC_PWM);
+    audio_slice = pwm_gpio_to_slice_num(gpio);
+    audio_chan = pwm_gpio_to_channel(gpio);
+    pwmcfg = pwm_get_default_config();
+#ifdef AUDIO_WAVETABLE
+    // ~490kHz carrier, the sample level is rewritten by DMA at AUDIO_RATE
+    pwm_config_set_clkdiv_int(&pwmcfg, 1);
+    pwm_init(audio_slice, &pwmcfg, false);
+    pwm_set_wrap(audio_slice, 255);
+
+    timer = dma_claim_unused_timer(true);
+    dma_timer_set_fraction(timer, 1, clock_get_hz(clk_sys) / AUDIO_RATE);
+
+    audio_dma = dma_claim_unused_channel(true);
+    dmacfg = dma_channel_get_default_config(audio_dma);
+    channel_config_set_transfer_data_size(&dmacfg, DMA_SIZE_32);
+    channel_config_set_read_increment(&dmacfg, true);
+    channel_config_set_write_increment(&dmacfg, false);
+    channel_config_set_ring(&dmacfg, false, 8);
+    channel_config_set_dreq(&dmacfg, dma_get_timer_dreq(timer));
+    dma_channel_configure(audio_dma, &dmacfg, &pwm_hw->slice[audio_slice].cc,
+                          audio_wave, 0xFFFFFFFF, false);
+#else
+    pwm_config_set_clkdiv(&pwmcfg, 125);
+    pwm_init(audio_slice, &pwmcfg, false);
+    pwm_set_wrap(audio_slice, 500);
+#endif
+    pwm_set_chan_level(audio_slice, audio_chan, 0);
+    pwm_set_enabled(audio_slice, true);
+
+    // core0 can ask for the mount chime before core1 gets here
+    __dmb();
+    audio_ready = true;
+}
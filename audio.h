@@ -0,0 +1,11 @@
+#ifndef __AUDIO_H
+#define __AUDIO_H
+
+#define AUDIO_CLICK (0)
+#define AUDIO_BELL  (1)
+
+extern void audio_init(uint gpio);
+extern void audio_play(uint voice, uint8_t volume, uint32_t duration_us);
+extern void audio_silence();
+
+#endif /* __AUDIO_H */
\ No newline at end of file
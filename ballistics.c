@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <pico/stdlib.h>
+
+#include "ballistics.h"
+
+// Pointer ballistics for USB mice, integer only. The gain for a sample is
+// looked up from its speed, and the fraction of a count left over after
+// scaling is carried into the next sample so slow motion is not lost.
+
+static uint16_t gain[BALLISTICS_SPEEDS];    // 8.8 fixed point
+static int32_t carry_x, carry_y;            // 24.8 fixed point, 0 <= carry < 1
+static volatile bool carry_reset;           // Set by core1, carry dropped on core0
+
+// Gain rises linearly from gain_low at rest to gain_high at the knee
+void ballistics_set(uint16_t gain_low, uint16_t gain_high, uint8_t knee) {
+    int s;
+
+    if(knee == 0)
+        knee = 1;
+
+    for(s = 0; s < BALLISTICS_SPEEDS; s++) {
+        if(s >= knee)
+            gain[s] = gain_high;
+        else
+            gain[s] = gain_low + ((int32_t)(gain_high - gain_low) * s) / knee;
+    }
+
+    carry_x = 0;
+    carry_y = 0;
+}
+
+void ballistics_init() {
+    ballistics_set(BALLISTICS_GAIN_LOW, BALLISTICS_GAIN_HIGH, BALLISTICS_KNEE);
+}
+
+// Called from the stream side (core1) when the engine or mode changes, so
+// a remainder from the old stream does not leak into the new one. The
+// carry belongs to core0, it is dropped there on the next report.
+void ballistics_reset() {
+    carry_reset = true;
+}
+
+static inline int16_t ballistics_clamp(int32_t v) {
+    if(v > INT16_MAX)
+        return INT16_MAX;
+    if(v < INT16_MIN)
+        return INT16_MIN;
+    return v;
+}
+
+// Called from the USB side (core0) for every mouse report, interval_us
+// being the time since the previous one.
+void ballistics_apply(int16_t *x, int16_t *y, uint32_t interval_us) {
+    uint32_t ax = (*x < 0) ? -*x : *x;
+    uint32_t ay = (*y < 0) ? -*y : *y;
+    uint32_t mag, speed;
+    int32_t g;
+
+    // |v| ~= max + min / 2, within 12%
+    mag = (ax > ay) ? ax + (ay >> 1) : ay + (ax >> 1);
+
+    if(interval_us < 125)
+        interval_us = 125;
+    speed = (mag * 1000) / interval_us;
+    g = gain[(speed < BALLISTICS_SPEEDS) ? speed : BALLISTICS_SPEEDS - 1];
+
+    if(carry_reset) {
+        carry_reset = false;
+        carry_x = 0;
+        carry_y = 0;
+    }
+
+    carry_x += *x * g;
+    carry_y += *y * g;
+
+    // Arithmetic shifts floor, leaving the remainder in [0, 1) count
+    *x = ballistics_clamp(carry_x >> 8);
+    *y = ballistics_clamp(carry_y >> 8);
+    carry_x &= 0xFF;
+    carry_y &= 0xFF;
+}
@@ -0,0 +1,26 @@
+#ifndef __BALLISTICS_H
+#define __BALLISTICS_H
+
+// Acceleration curve, gains are 8.8 fixed point and the knee is the speed
+// in counts per ms where the gain reaches its maximum. The default is
+// unity, motion passes through unchanged; override at build time to suit
+// the mouse resolution.
+#ifndef BALLISTICS_GAIN_LOW
+#define BALLISTICS_GAIN_LOW   (256)
+#endif
+#ifndef BALLISTICS_GAIN_HIGH
+#define BALLISTICS_GAIN_HIGH  (256)
+#endif
+#ifndef BALLISTICS_KNEE
+#define BALLISTICS_KNEE       (32)
+#endif
+
+// Speeds in counts per ms covered by the table, faster uses the last entry
+#define BALLISTICS_SPEEDS     (64)
+
+extern void ballistics_init();
+extern void ballistics_set(uint16_t gain_low, uint16_t gain_high, uint8_t knee);
+extern void ballistics_reset();
+extern void ballistics_apply(int16_t *x, int16_t *y, uint32_t interval_us);
+
+#endif /* __BALLISTICS_H */
\ No newline at end of file
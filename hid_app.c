@@ -23,164 +23,188 @@
  *
  */
 
+#include <pico/stdlib.h>
+
 #include "bsp/board.h"
 #include "tusb.h"
 #include "keyboard.h"
+#include "stream.h"
 #include "mouse.h"
+#include "tablet.h"
+#include "hid_parse.h"
+#include "keymap.h"
 
 //--------------------------------------------------------------------+
 // MACRO TYPEDEF CONSTANT ENUM DECLARATION
 //--------------------------------------------------------------------+
 
-#define MAX_REPORT  4
-
-static uint8_t const keycode2dec[256] = { 
-    0x00, /* 0x00 NONE */
-    0x00, /* 0x01 ERR ROLLOVER */
-    0x00, /* 0x02 POST FAIL */
-    0x00, /* 0x03 UNDEFINED */
-    0xC2, /* 0x04 'A' */
-    0xD9, /* 0x05 'B' */
-    0xCE, /* 0x06 'C' */
-    0xCD, /* 0x07 'D' */
-    0xCC, /* 0x08 'E' */
-    0xD2, /* 0x09 'F' */
-    0xD8, /* 0x0a 'G' */
-    0xDD, /* 0x0b 'H' */
-    0xE6, /* 0x0c 'I' */
-    0xE2, /* 0x0d 'J' */
-    0xE7, /* 0x0e 'K' */
-    0xEC, /* 0x0f 'L' */
-    0xE3, /* 0x10 'M' */
-    0xDE, /* 0x11 'N' */
-    0xEB, /* 0x12 'O' */
-    0xF0, /* 0x13 'P' */
-    0xC1, /* 0x14 'Q' */
-    0xD1, /* 0x15 'R' */
-    0xC7, /* 0x16 'S' */
-    0xD7, /* 0x17 'T' */
-    0xE1, /* 0x18 'U' */
-    0xD3, /* 0x19 'V' */
-    0xC6, /* 0x1a 'W' */
-    0xC8, /* 0x1b 'X' */
-    0xDC, /* 0x1c 'Y' */
-    0xC3, /* 0x1d 'Z' */
-    0xC0, /* 0x1e '!' */
-    0xC5, /* 0x1f '@' */
-    0xCB, /* 0x20 '#' */
-    0xD0, /* 0x21 '$' */
-    0xD6, /* 0x22 '%' */
-    0xDB, /* 0x23 '^' */
-    0xE0, /* 0x24 '&' */
-    0xE5, /* 0x25 '*' */
-    0xEA, /* 0x26 '(' */
-    0xEF, /* 0x27 ')' */
-    0xBD, /* 0x28 CR  */
-    0x71, /* 0x29 ESC */
-    0xBC, /* 0x2a BS  */
-    0xBE, /* 0x2b Tab */
-    0xD4, /* 0x2c ' ' */
-    0xF9, /* 0x2d '_' */
-    0xF5, /* 0x2e '+' */
-    0xFA, /* 0x2f '{' */
-    0xF6, /* 0x30 '}' */
-    0xF7, /* 0x31 '|' */
-    0xBF, /* 0x32 '#' */
-    0xF2, /* 0x33 ';' */
-    0xE8, /* 0x34 ''' */
-    0xBF, /* 0x35 '`' */
-    0xFB, /* 0x36 ',' */
-    0xED, /* 0x37 '.' */
-    0xF3, /* 0x38 '/' */
-    0x00, /* 0x39 CAPS */
-    0x56, /* 0x3a F1 */
-    0x57, /* 0x3b F2 */
-    0x58, /* 0x3c F3 */
-    0x59, /* 0x3d F4 */
-    0x5A, /* 0x3e F5 */
-    0x64, /* 0x3f F6 */
-    0x65, /* 0x40 F7 */
-    0x66, /* 0x41 F8 */
-    0x67, /* 0x42 F9 */
-    0x68, /* 0x43 F10 */
-    0x71, /* 0x44 F11 */
-    0x72, /* 0x45 F12 */
-    0x7C, /* 0x46 SysRq */
-    0x7D, /* 0x47 Scroll */
-    0xB0, /* 0x48 Pause */
-    0x8B, /* 0x49 INS */
-    0x8A, /* 0x4a HOME */
-    0x8E, /* 0x4b PGUP */
-    0x8C, /* 0x4c DEL */
-    0x8D, /* 0x4d END */
-    0x8F, /* 0x4e PGDN */
-    0xA8, /* 0x4f RIGHT */
-    0xA7, /* 0x50 LEFT */
-    0xA9, /* 0x51 DOWN */
-    0xAA, /* 0x52 UP */
-    0xA1, /* 0x53 NUMLOCK */
-    0xA2, /* 0x54 '/' */
-    0xA3, /* 0x55 '*' */
-    0xA4, /* 0x56 '-' */
-    0x9C, /* 0x57 '+' */
-    0x95, /* 0x58 ENT */
-    0x96, /* 0x59 '1' */
-    0x97, /* 0x5a '2' */
-    0x98, /* 0x5b '3' */
-    0x99, /* 0x5c '4' */
-    0x9A, /* 0x5d '5' */
-    0x9B, /* 0x5e '6' */
-    0x9D, /* 0x5f '7' */
-    0x9E, /* 0x60 '8' */
-    0x9F, /* 0x61 '9' */
-    0x92, /* 0x62 '0' */
-    0x94, /* 0x63 '.' */
-    0xF7, /* 0x64 '|' */
-    0xB1, /* 0x65 COMPOSE */
-    0x00, /* 0x66 POWER */
-    0xF5, /* 0x67 '=' */
-    0x73, /* 0x68 F13 */
-    0x74, /* 0x69 F14 */
-    0x7C, /* 0x6A F15 */
-    0x7D, /* 0x6B F16 */
-    0x80, /* 0x6C F17 */
-    0x81, /* 0x6D F18 */
-    0x82, /* 0x6E F19 */
-    0x83, /* 0x6F F20 */
-    0xA1, /* 0x70 F21 */
-    0xA2, /* 0x71 F22 */
-    0xA3, /* 0x72 F23 */
-    0xA4, /* 0x73 F24 */
-    0x7D, /* 0x74 Open */
-    0x7C, /* 0x75 Help */
-    0x74, /* 0x76 Menu */
-    0x8D, /* 0x77 Select */
-    0x00, /* 0x78 Stop */
-    0x00, /* 0x79 Again */
-    0x00, /* 0x7a Undo */
-    0x00, /* 0x7b Cut */
-    0x00, /* 0x7c Copy */
-    0x00, /* 0x7d Paste */
-    0x8A, /* 0x7e Find */
-    0x00, /* 0x7f Mute */
-};
-
-
-
-// Each HID instance can has multiple reports
-static struct
-{
-  uint8_t report_count;
-  tuh_hid_report_info_t report_info[MAX_REPORT];
-}hid_info[CFG_TUH_HID];
-
-static void process_kbd_report(hid_keyboard_report_t const *report);
+// Report buffer for compiled plans, room for the padding hid_extract() reads
+#define PLAN_REPORT_SIZE  (CFG_TUH_HID_EPIN_BUFSIZE + HID_EXTRACT_PAD)
+
+// What a report feeds, each interface has at most one plan of each kind
+#define PLAN_KEYBOARD  1
+#define PLAN_ABSOLUTE  2
+#define PLAN_MOUSE     3
+#define PLAN_CONSUMER  4
+#define PLAN_SYSTEM    5
+#define PLAN_KINDS     5
+
+// Control usages compiled per report, array elements and single bits
+#define CTL_ARRAY  4
+#define CTL_BITS   16
+
+// Highest device address TinyUSB hands out, hubs take addresses too
+#define HID_DEV_ADDR_MAX  (CFG_TUH_DEVICE_MAX + CFG_TUH_HUB)
+
+// Minimum time between LED updates sent to a keyboard
+#define LED_INTERVAL_MS  50
+
+// Key bitmaps are read this many bits at a time, every 3 bytes along
+#define KBD_CHUNK_BITS  24
+
+// Keyboard fields found in a report protocol descriptor, compiled for
+// hid_extract(). Bitmap chunks and array slots share one plan each, as
+// they are whole bytes apart.
+typedef struct
+{
+  uint8_t report_id;
+  uint8_t bitmaps;
+  struct
+  {
+    hid_extract_t chunk;  // first KBD_CHUNK_BITS bits
+    uint16_t first;       // usage of the first bit
+    uint16_t count;
+  } bitmap[2];            // NKRO key bitmap and modifier bitmap
+  hid_extract_t array;    // first slot
+  uint8_t array_count;    // 0 when there is no key array
+  uint16_t span;          // report bytes read, shorter reports are padded
+  bool nkro;              // a bitmap reaches past the modifiers
+  uint8_t led_report_id;  // output report holding the LEDs
+  bool leds_found;
+} kbd_layout_t;
+
+// Mounted keyboard interfaces, each with its own set of keys down
+typedef struct
+{
+  uint8_t dev_addr;       // 0 when not a keyboard
+  uint8_t instance;
+  bool boot;              // boot keyboard, takes LED output reports
+  kbd_layout_t layout;
+  uint32_t keys[8];       // usages down, as a 256 bit set
+  uint8_t down[256];      // LK201 code each usage went down as
+  uint8_t leds;           // last LED report sent, 0xFF to force an update
+  uint8_t led_report[2];  // SET_REPORT buffer, must outlive the transfer
+  bool led_busy;
+} kbd_itf_t;
+
+// Absolute axis, scaled to the tablet range
+typedef struct
+{
+  hid_extract_t field;
+  int32_t min;
+  int32_t max;
+  uint32_t scale;         // 16.16, logical range to 0-TABLET_MAX
+} abs_axis_t;
+
+// Mounted digitizers and absolute pointers, feeding the tablet
+typedef struct
+{
+  uint8_t dev_addr;       // 0 when not an absolute pointer
+  uint8_t instance;
+  uint8_t report_id;
+  abs_axis_t axis[2];     // X and Y
+  hid_extract_t in_range;
+  uint8_t always_in_range;  // 1 when the device has no In Range
+  hid_extract_t button[4];  // tablet buttons 1-4
+  uint16_t x, y;          // last position, kept while out of range
+} abs_itf_t;
+
+// Absolute X and Y seen per report ID while picking the pointer report
+typedef struct
+{
+  uint32_t x[8];
+  uint32_t y[8];
+  int16_t report_id;      // first report with both, -1 for none
+} abs_scan_t;
+
+// Report protocol relative mice
+typedef struct
+{
+  uint8_t report_id;
+  uint8_t fields;         // fields found while parsing
+  hid_extract_t x, y;
+  hid_extract_t wheel;    // compiled, the DEC mouse has no wheel to send it to
+  hid_extract_t buttons;  // Button page usages 1-5, as the boot report bits
+} rel_layout_t;
+
+// Consumer and system control reports, usage arrays and on/off bits
+typedef struct
+{
+  uint8_t report_id;
+  uint8_t fields;         // fields found while parsing
+  uint16_t page;
+  uint8_t array_count;
+  hid_extract_t array[CTL_ARRAY];
+  hid_field_t array_field;  // usages and logical range the values index
+  uint8_t bit_count;
+  hid_extract_t bit[CTL_BITS];
+  uint16_t bit_usage[CTL_BITS];
+  uint32_t keys[8];       // LK201 codes held, as a 256 bit set
+} ctl_layout_t;
+
+// One record per mounted HID interface, from a pool of CFG_TUH_HID. The
+// instance number is only unique within a device, so records are found
+// by (dev_addr, instance) through hid_index.
+typedef struct
+{
+  uint8_t dev_addr;       // 0 when the record is free
+  uint8_t instance;
+  bool report_ids;        // reports start with their ID
+  uint8_t plans;
+  struct
+  {
+    uint8_t report_id;
+    uint8_t kind;
+  } plan[PLAN_KINDS];     // compiled at mount, reports without one are ignored
+  kbd_itf_t kbd;          // kbd.dev_addr set for keyboards
+  abs_itf_t abs;          // abs.dev_addr set for absolute pointers
+  rel_layout_t rel;
+  ctl_layout_t consumer;
+  ctl_layout_t system;
+} hid_itf_t;
+
+static hid_itf_t hid_itf[CFG_TUH_HID];
+
+// Record number + 1 for each (dev_addr, instance), 0 when not mounted
+static uint8_t hid_index[HID_DEV_ADDR_MAX + 1][CFG_TUH_HID];
+
+static hid_itf_t* hid_find(uint8_t dev_addr, uint8_t instance);
+static hid_itf_t* hid_alloc(uint8_t dev_addr, uint8_t instance);
+static void hid_free(hid_itf_t *itf);
+static kbd_itf_t* kbd_find(uint8_t dev_addr, uint8_t instance);
+static void process_kbd_report(kbd_itf_t *kbd, hid_keyboard_report_t const *report);
+static void process_kbd_layout(kbd_itf_t *kbd, uint8_t const* report, uint16_t len);
+static void kbd_layout_field(hid_field_t const *field, void *ctx);
+static void kbd_led_field(hid_field_t const *field, void *ctx);
+static void kbd_update_keys(kbd_itf_t *kbd, uint32_t const keys[8]);
+static abs_itf_t* abs_find(uint8_t dev_addr, uint8_t instance);
+static void abs_scan_field(hid_field_t const *field, void *ctx);
+static void abs_layout_field(hid_field_t const *field, void *ctx);
+static void process_abs_report(abs_itf_t *abs, uint8_t const* report);
+static void rel_layout_field(hid_field_t const *field, void *ctx);
+static void process_rel_report(rel_layout_t const *rel, uint8_t const* report);
+static void ctl_layout_field(hid_field_t const *field, void *ctx);
+static void process_ctl_report(ctl_layout_t *ctl, uint8_t const* report);
+static void hid_add_plan(hid_itf_t *itf, uint8_t report_id, uint8_t kind);
 static void process_mouse_report(hid_mouse_report_t const * report);
+static void process_mouse_motion(int16_t x, int16_t y, uint8_t usb_buttons);
 static void process_generic_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len);
+static void kbd_leds_task(void);
 
 void hid_app_task(void)
 {
-  // nothing to do
+  kbd_leds_task();
+  mouse_packet_flush();
 }
 
 //--------------------------------------------------------------------+
@@ -203,12 +227,92 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 
   //printf("HID Interface Protocol = %s\r\n", protocol_str[itf_protocol]);
 
+  hid_itf_t *itf = hid_alloc(dev_addr, instance);
+  if ( !itf )
+  {
+    //printf("No free HID interface record\r\n");
+    return;
+  }
+
   // By default host stack will use activate boot protocol on supported interface.
-  // Therefore for this simple example, we only need to parse generic report descriptor (with built-in parser)
+  // Every interface gets its reports decoded through plans compiled here from
+  // the descriptor, one per kind of report we understand. Boot keyboards stay
+  // in boot protocol unless their descriptor has an NKRO bitmap.
+  kbd_layout_t layout = { 0 };
+  hid_parse_inputs(desc_report, desc_len, kbd_layout_field, &layout);
+  hid_parse_outputs(desc_report, desc_len, kbd_led_field, &layout);
+
+  if ( itf_protocol == HID_ITF_PROTOCOL_KEYBOARD || layout.bitmaps || layout.array_count )
+  {
+    kbd_itf_t *kbd = &itf->kbd;
+
+    kbd->dev_addr = dev_addr;
+    kbd->instance = instance;
+    kbd->boot = (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD);
+    kbd->layout = layout;
+    kbd->leds = 0xFF;
+    hid_add_plan(itf, layout.report_id, PLAN_KEYBOARD);
+
+    if ( itf_protocol == HID_ITF_PROTOCOL_KEYBOARD && layout.nkro )
+    {
+      tuh_hid_set_protocol(dev_addr, instance, HID_PROTOCOL_REPORT);
+    }
+  }
+
+  // Pen tablets, touchscreens and absolute mice drive the DEC tablet
   if ( itf_protocol == HID_ITF_PROTOCOL_NONE )
   {
-    hid_info[instance].report_count = tuh_hid_parse_report_descriptor(hid_info[instance].report_info, MAX_REPORT, desc_report, desc_len);
-    //printf("HID has %u reports \r\n", hid_info[instance].report_count);
+    // Composite devices often put a relative mouse in another report of the
+    // same application, so find the report with absolute X and Y first
+    abs_scan_t scan = { .report_id = -1 };
+    abs_itf_t pointer = { 0 };
+    hid_parse_inputs(desc_report, desc_len, abs_scan_field, &scan);
+
+    if ( scan.report_id >= 0 )
+    {
+      pointer.report_id = scan.report_id;
+      hid_parse_inputs(desc_report, desc_len, abs_layout_field, &pointer);
+    }
+
+    if ( pointer.axis[0].field.mask && pointer.axis[1].field.mask )
+    {
+      abs_itf_t *abs = &itf->abs;
+
+      *abs = pointer;
+      abs->always_in_range = !pointer.in_range.mask;
+      abs->dev_addr = dev_addr;
+      abs->instance = instance;
+      hid_add_plan(itf, abs->report_id, PLAN_ABSOLUTE);
+      stream_select(&tablet_engine);
+    }
+
+    // Relative mice that only make sense in report protocol
+    rel_layout_t rel = { 0 };
+    hid_parse_inputs(desc_report, desc_len, rel_layout_field, &rel);
+
+    if ( !itf->abs.dev_addr && rel.x.mask && rel.y.mask )
+    {
+      itf->rel = rel;
+      hid_add_plan(itf, rel.report_id, PLAN_MOUSE);
+      stream_select(TABLET_EMULATION ? &tablet_engine : &mouse_engine);
+    }
+
+    // Media, application and system keys bound to LK201 keys
+    itf->consumer.page = HID_USAGE_PAGE_CONSUMER;
+    hid_parse_inputs(desc_report, desc_len, ctl_layout_field, &itf->consumer);
+    if ( itf->consumer.array_count || itf->consumer.bit_count )
+      hid_add_plan(itf, itf->consumer.report_id, PLAN_CONSUMER);
+
+    itf->system.page = HID_USAGE_PAGE_DESKTOP;
+    hid_parse_inputs(desc_report, desc_len, ctl_layout_field, &itf->system);
+    if ( itf->system.array_count || itf->system.bit_count )
+      hid_add_plan(itf, itf->system.report_id, PLAN_SYSTEM);
+  }
+
+  // The last pointing device plugged in decides what uart1 emulates
+  if ( itf_protocol == HID_ITF_PROTOCOL_MOUSE )
+  {
+    stream_select(TABLET_EMULATION ? &tablet_engine : &mouse_engine);
   }
 
   // request to receive report
@@ -222,7 +326,45 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 // Invoked when device with hid interface is un-mounted
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance)
 {
+  static uint32_t const none[8] = { 0 };
+  hid_itf_t *itf = hid_find(dev_addr, instance);
+  kbd_itf_t *kbd = kbd_find(dev_addr, instance);
+
   keyboard_sound(125);
+
+  // Release whatever this keyboard still held down
+  if ( kbd )
+  {
+    kbd_update_keys(kbd, none);
+    kbd->dev_addr = 0;
+  }
+
+  abs_itf_t *abs = abs_find(dev_addr, instance);
+  if ( abs )
+  {
+    tablet_sample(abs->x, abs->y, 0);
+    abs->dev_addr = 0;
+
+    // Back to a mouse once the last absolute pointer is gone
+    bool tablets = false;
+    for(uint8_t i=0; i<CFG_TUH_HID; i++)
+    {
+      if ( hid_itf[i].dev_addr && hid_itf[i].abs.dev_addr ) tablets = true;
+    }
+    if ( !tablets ) stream_select(TABLET_EMULATION ? &tablet_engine : &mouse_engine);
+  }
+
+  // And whatever its control keys held
+  if ( itf )
+  {
+    for(uint16_t code=0; code<256; code++)
+    {
+      if ( (itf->consumer.keys[code >> 5] >> (code & 31)) & 1 ) keyboard_key(code, false);
+      if ( (itf->system.keys[code >> 5] >> (code & 31)) & 1 ) keyboard_key(code, false);
+    }
+    hid_free(itf);
+  }
+
   //printf("HID device address = %d, instance = %d is unmounted\r\n", dev_addr, instance);
 }
 
@@ -234,8 +376,25 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
   switch (itf_protocol)
   {
     case HID_ITF_PROTOCOL_KEYBOARD:
+    {
+      kbd_itf_t *kbd = kbd_find(dev_addr, instance);
+      if ( !kbd ) break;
+
+      if ( tuh_hid_get_protocol(dev_addr, instance) == HID_PROTOCOL_REPORT )
+      {
+        // Report protocol, report ID first if the descriptor declares one
+        if ( kbd->layout.report_id )
+        {
+          if ( len == 0 || report[0] != kbd->layout.report_id ) break;
+          report++;
+          len--;
+        }
+        process_kbd_layout(kbd, report, len);
+        break;
+      }
       //TU_LOG2("HID receive boot keyboard report\r\n");
-      process_kbd_report( (hid_keyboard_report_t const*) report );
+      process_kbd_report(kbd, (hid_keyboard_report_t const*) report );
+    }
     break;
 
     case HID_ITF_PROTOCOL_MOUSE:
@@ -256,55 +415,311 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
   }
 }
 
+//--------------------------------------------------------------------+
+// Interface records
+//--------------------------------------------------------------------+
+
+static hid_itf_t* hid_find(uint8_t dev_addr, uint8_t instance)
+{
+  if ( dev_addr > HID_DEV_ADDR_MAX || instance >= CFG_TUH_HID ) return NULL;
+
+  uint8_t const idx = hid_index[dev_addr][instance];
+  return idx ? &hid_itf[idx - 1] : NULL;
+}
+
+static hid_itf_t* hid_alloc(uint8_t dev_addr, uint8_t instance)
+{
+  if ( dev_addr == 0 || dev_addr > HID_DEV_ADDR_MAX || instance >= CFG_TUH_HID ) return NULL;
+
+  // A record left over from a missed unmount is reused
+  hid_itf_t *itf = hid_find(dev_addr, instance);
+
+  for(uint8_t i=0; !itf && i<CFG_TUH_HID; i++)
+  {
+    if ( hid_itf[i].dev_addr == 0 ) itf = &hid_itf[i];
+  }
+  if ( !itf ) return NULL;
+
+  memset(itf, 0, sizeof(hid_itf_t));
+  itf->dev_addr = dev_addr;
+  itf->instance = instance;
+  hid_index[dev_addr][instance] = (itf - hid_itf) + 1;
+
+  return itf;
+}
+
+static void hid_free(hid_itf_t *itf)
+{
+  hid_index[itf->dev_addr][itf->instance] = 0;
+  itf->dev_addr = 0;
+}
+
+static void hid_add_plan(hid_itf_t *itf, uint8_t report_id, uint8_t kind)
+{
+  if ( itf->plans >= PLAN_KINDS ) return;
+
+  itf->plan[itf->plans].report_id = report_id;
+  itf->plan[itf->plans].kind = kind;
+  itf->plans++;
+
+  // Report IDs are all or nothing within a descriptor
+  if ( report_id ) itf->report_ids = true;
+}
+
+// Compile a field for hid_extract(), absent when it could reach past the report buffer
+static void plan_field(hid_extract_t *ex, hid_field_t const *field, uint16_t index, bool is_signed)
+{
+  uint16_t const offset = field->bit_offset + index * field->size;
+
+  if ( offset / 8 + 4 > PLAN_REPORT_SIZE ) return;
+  hid_extract_compile(ex, offset, field->size, is_signed);
+}
+
+// Compiled fields read whole words, a report shorter than the span they
+// read is copied into buf with zeroed padding to run into
+static uint8_t const* plan_report(uint8_t buf[PLAN_REPORT_SIZE], uint8_t const* report, uint16_t len, uint16_t span)
+{
+  if ( len >= span ) return report;
+
+  if ( len > CFG_TUH_HID_EPIN_BUFSIZE ) len = CFG_TUH_HID_EPIN_BUFSIZE;
+  memcpy(buf, report, len);
+  memset(buf + len, 0, PLAN_REPORT_SIZE - len);
+  return buf;
+}
+
 //--------------------------------------------------------------------+
 // Keyboard
 //--------------------------------------------------------------------+
 
-// look up new key in previous keys
-static inline bool find_key_in_report(hid_keyboard_report_t const *report, uint8_t keycode)
+static kbd_itf_t* kbd_find(uint8_t dev_addr, uint8_t instance)
 {
-  for(uint8_t i=0; i<6; i++)
+  hid_itf_t *itf = hid_find(dev_addr, instance);
+  return (itf && itf->kbd.dev_addr) ? &itf->kbd : NULL;
+}
+
+// Collect the keyboard page fields of the first keyboard report
+static void kbd_layout_field(hid_field_t const *field, void *ctx)
+{
+  kbd_layout_t *layout = (kbd_layout_t *) ctx;
+
+  if ( field->app_page != HID_USAGE_PAGE_DESKTOP || field->app_usage != HID_USAGE_DESKTOP_KEYBOARD ) return;
+  if ( field->usage_page != HID_USAGE_PAGE_KEYBOARD ) return;
+  if ( (layout->bitmaps || layout->array_count) && field->report_id != layout->report_id ) return;
+
+  layout->report_id = field->report_id;
+
+  if ( (field->flags & HID_FIELD_VARIABLE) && field->size == 1 )
   {
-    if (report->keycode[i] == keycode)  return true;
+    uint16_t const chunks = (field->count + KBD_CHUNK_BITS - 1) / KBD_CHUNK_BITS;
+    uint16_t const span = field->bit_offset / 8 + (chunks - 1) * (KBD_CHUNK_BITS / 8) + HID_EXTRACT_PAD;
+
+    if ( layout->bitmaps < 2 && field->count && span <= PLAN_REPORT_SIZE )
+    {
+      uint16_t const first = field->usage_count ? field->usages[0] : field->usage_min;
+
+      hid_extract_compile(&layout->bitmap[layout->bitmaps].chunk, field->bit_offset, KBD_CHUNK_BITS, false);
+      layout->bitmap[layout->bitmaps].first = first;
+      layout->bitmap[layout->bitmaps].count = field->count;
+      layout->bitmaps++;
+      if ( span > layout->span ) layout->span = span;
+
+      // Every boot keyboard has the 0xE0-0xE7 modifier bitmap, only keys
+      // outside it make the report worth switching to
+      if ( first < 0xE0 || first + field->count > 0xE8 ) layout->nkro = true;
+    }
   }
+  else if ( !(field->flags & HID_FIELD_VARIABLE) && field->size == 8 && !layout->array_count && field->count )
+  {
+    uint8_t const count = (field->count < 255) ? field->count : 255;
+    uint16_t const span = field->bit_offset / 8 + (count - 1) + HID_EXTRACT_PAD;
+
+    if ( span > PLAN_REPORT_SIZE ) return;
+
+    hid_extract_compile(&layout->array, field->bit_offset, 8, false);
+    layout->array_count = count;
+    if ( span > layout->span ) layout->span = span;
+  }
+}
 
-  return false;
+// Note the output report of the first keyboard LED field
+static void kbd_led_field(hid_field_t const *field, void *ctx)
+{
+  kbd_layout_t *layout = (kbd_layout_t *) ctx;
+
+  if ( field->app_page != HID_USAGE_PAGE_DESKTOP || field->app_usage != HID_USAGE_DESKTOP_KEYBOARD ) return;
+  if ( field->usage_page != HID_USAGE_PAGE_LED || layout->leds_found ) return;
+
+  layout->led_report_id = field->report_id;
+  layout->leds_found = true;
 }
 
-static void process_kbd_report(hid_keyboard_report_t const *report)
+// Diff the usages down against the previous report a word at a time and
+// pass each press and release on to the LK201 engine. A key is released
+// as the code it was pressed as, whatever Fn or the keymap did since.
+// The modifier word goes first, so Shift changes reach the host before
+// the keys pressed or released with them in the same report.
+static void kbd_update_keys(kbd_itf_t *kbd, uint32_t const keys[8])
 {
-  static hid_keyboard_report_t prev_report = { 0, 0, {0} }; // previous report to check key released
+  uint32_t *prev = kbd->keys;
+  keymap_t const *map = keymap_current();
+  bool const fn = map->fn_key && ((keys[map->fn_key >> 5] >> (map->fn_key & 31)) & 1);
+  // Usages 0xE0-0xE7 in the low byte of the last word are the modifier byte
+  bool const shift = keys[7] & (KEYBOARD_MODIFIER_LEFTSHIFT | KEYBOARD_MODIFIER_RIGHTSHIFT);
 
-  // Modifier Keys
-  keystate[0xAE] = (report->modifier & (KEYBOARD_MODIFIER_LEFTSHIFT | KEYBOARD_MODIFIER_RIGHTSHIFT)) ? 1 : 0;
-  keystate[0xAF] = (report->modifier & (KEYBOARD_MODIFIER_LEFTCTRL | KEYBOARD_MODIFIER_RIGHTCTRL)) ? 1 : 0;
-  keystate[0xB1] = (report->modifier & (KEYBOARD_MODIFIER_LEFTALT | KEYBOARD_MODIFIER_RIGHTALT)) ? 1 : 0;
-  //keystate[0xB2] = (report->modifier & (KEYBOARD_MODIFIER_LEFTMETA | KEYBOARD_MODIFIER_RIGHTMETA)) ? 1 : 0;
+  for(uint8_t i=0; i<8; i++)
+  {
+    uint8_t const w = (i + 7) & 7;
+    uint32_t diff = keys[w] ^ prev[w];
+
+    while ( diff )
+    {
+      uint8_t const bit = __builtin_ctz(diff);
+      uint8_t const usage = (w << 5) | bit;
+      bool const down = (keys[w] >> bit) & 1;
+      diff &= diff - 1;
 
-  for(uint8_t i=0; i<6; i++) {
-    if ( prev_report.keycode[i] ) {
-      if ( !find_key_in_report(report, prev_report.keycode[i]) ) {
-        if(keycode2dec[prev_report.keycode[i]] != 0)
-            keystate[keycode2dec[prev_report.keycode[i]]] = 0;
+      if ( !down )
+      {
+        if ( kbd->down[usage] ) keyboard_key(kbd->down[usage], false);
+        kbd->down[usage] = 0;
+        continue;
       }
+
+      uint16_t const entry = keymap_lookup(map, usage, shift, fn);
+      uint8_t const code = entry & 0xFF;
+
+      kbd->down[usage] = code;
+      if ( code == 0 ) continue;
+
+      if ( entry & (KEYMAP_SHIFT_UP | KEYMAP_SHIFT_DOWN) )
+        keyboard_key_shifted(code, entry & KEYMAP_SHIFT_DOWN);
+      else
+        keyboard_key(code, true);
     }
-    if ( report->keycode[i] ) {
-      if ( !find_key_in_report(&prev_report, report->keycode[i]) ) {
-        if(keycode2dec[report->keycode[i]] != 0)
-            keystate[keycode2dec[report->keycode[i]]] = 1;
-
-        // not existed in previous report means the current key is newly pressed
-        //bool const is_shift = report->modifier & (KEYBOARD_MODIFIER_LEFTSHIFT | KEYBOARD_MODIFIER_RIGHTSHIFT);
-        //uint8_t ch = keycode2ascii[report->keycode[i]][is_shift ? 1 : 0];
-        //putchar(ch);
-        //if ( ch == '\r' ) putchar('\n'); // added new line for enter key
-
-        //fflush(stdout); // flush right away, else nanolib will wait for newline
-      }
+
+    prev[w] = keys[w];
+  }
+}
+
+static inline void kbd_set_usage(uint32_t keys[8], uint16_t usage)
+{
+  if ( usage < 256 ) keys[usage >> 5] |= 1u << (usage & 31);
+}
+
+// Merge up to 32 bitmap bits into the set, bit 0 being usage
+static inline void kbd_set_usages(uint32_t keys[8], uint16_t usage, uint32_t bits)
+{
+  uint8_t const shift = usage & 31;
+
+  if ( usage >= 256 ) return;
+  keys[usage >> 5] |= bits << shift;
+  if ( shift && (usage >> 5) < 7 ) keys[(usage >> 5) + 1] |= bits >> (32 - shift);
+}
+
+static void process_kbd_report(kbd_itf_t *kbd, hid_keyboard_report_t const *report)
+{
+  uint32_t keys[8] = { 0 };
+
+  // Phantom state, keep the previous keys
+  if ( report->keycode[0] == 0x01 ) return;
+
+  keys[7] = report->modifier;
+  for(uint8_t i=0; i<6; i++)
+  {
+    if ( report->keycode[i] ) kbd_set_usage(keys, report->keycode[i]);
+  }
+
+  kbd_update_keys(kbd, keys);
+}
+
+// Report protocol keyboard, data starts after any report ID
+static void process_kbd_layout(kbd_itf_t *kbd, uint8_t const* report, uint16_t len)
+{
+  kbd_layout_t const *layout = &kbd->layout;
+  uint32_t keys[8] = { 0 };
+  uint8_t buf[PLAN_REPORT_SIZE];
+
+  report = plan_report(buf, report, len, layout->span);
+
+  for(uint8_t b=0; b<layout->bitmaps; b++)
+  {
+    uint16_t const count = layout->bitmap[b].count;
+
+    for(uint16_t i=0; i<count; i+=KBD_CHUNK_BITS)
+    {
+      uint32_t bits = hid_extract(report + i / 8, &layout->bitmap[b].chunk);
+
+      if ( count - i < KBD_CHUNK_BITS ) bits &= (1u << (count - i)) - 1;
+      kbd_set_usages(keys, layout->bitmap[b].first + i, bits);
+    }
+  }
+
+  for(uint8_t i=0; i<layout->array_count; i++)
+  {
+    uint8_t const usage = hid_extract(report + i, &layout->array);
+
+    // Phantom state, keep the previous keys
+    if ( usage == 0x01 ) return;
+    if ( usage ) kbd_set_usage(keys, usage);
+  }
+
+  kbd_update_keys(kbd, keys);
+}
+
+// LK201 Wait, Compose, Lock and Hold Screen as USB keyboard LEDs
+static uint8_t kbd_leds_report(void)
+{
+  uint8_t leds = 0;
+
+  if ( ledstate[0] ) leds |= KEYBOARD_LED_NUMLOCK;
+  if ( ledstate[1] ) leds |= KEYBOARD_LED_COMPOSE;
+  if ( ledstate[2] ) leds |= KEYBOARD_LED_CAPSLOCK;
+  if ( ledstate[3] ) leds |= KEYBOARD_LED_SCROLLLOCK;
+
+  return leds;
+}
+
+// Host LED commands only change ledstate[], this pushes the latest state
+// out at most every LED_INTERVAL_MS with one transfer per keyboard in flight.
+// Intermediate states a host toggles through in between are never sent.
+static void kbd_leds_task(void)
+{
+  static uint32_t last_ms = 0;
+  uint8_t const leds = kbd_leds_report();
+
+  if ( board_millis() - last_ms < LED_INTERVAL_MS ) return;
+
+  for(uint8_t i=0; i<CFG_TUH_HID; i++)
+  {
+    kbd_itf_t *kbd = &hid_itf[i].kbd;
+
+    if ( hid_itf[i].dev_addr == 0 || kbd->dev_addr == 0 || !kbd->boot || kbd->led_busy || kbd->leds == leds ) continue;
+
+    // Boot protocol has no report IDs, in report protocol a numbered
+    // report carries its ID in front of the data
+    uint8_t report_id = 0;
+    if ( tuh_hid_get_protocol(kbd->dev_addr, kbd->instance) == HID_PROTOCOL_REPORT ) report_id = kbd->layout.led_report_id;
+
+    kbd->led_report[0] = report_id;
+    kbd->led_report[1] = leds;
+    if ( tuh_hid_set_report(kbd->dev_addr, kbd->instance, report_id, HID_REPORT_TYPE_OUTPUT,
+                            report_id ? kbd->led_report : &kbd->led_report[1], report_id ? 2 : 1) )
+    {
+      kbd->led_busy = true;
+      kbd->leds = leds;
+      last_ms = board_millis();
     }
   }
+}
+
+void tuh_hid_set_report_complete_cb(uint8_t dev_addr, uint8_t instance, uint8_t report_id, uint8_t report_type, uint16_t len)
+{
+  (void) report_id;
+  (void) report_type;
+  (void) len;
 
-  prev_report = *report;
+  kbd_itf_t *kbd = kbd_find(dev_addr, instance);
+  if ( kbd ) kbd->led_busy = false;
 }
 
 //--------------------------------------------------------------------+
@@ -313,88 +728,379 @@ static void process_kbd_report(hid_keyboard_report_t const *report)
 
 static void process_mouse_report(hid_mouse_report_t const * report)
 {
-  static hid_mouse_report_t prev_report = { 0 };
+  process_mouse_motion(report->x, report->y, report->buttons);
+}
 
+// Relative motion and boot report button bits, from either protocol
+static void process_mouse_motion(int16_t x, int16_t y, uint8_t usb_buttons)
+{
   //------------- button state  -------------//
   uint8_t buttons = 0;
 
-  if(report->buttons & MOUSE_BUTTON_LEFT)
+  if(usb_buttons & MOUSE_BUTTON_LEFT)
       buttons |= 0x04;
 
-  if(report->buttons & MOUSE_BUTTON_MIDDLE)
+  if(usb_buttons & MOUSE_BUTTON_MIDDLE)
       buttons |= 0x02;
 
-  if(report->buttons & MOUSE_BUTTON_RIGHT)
+  if(usb_buttons & MOUSE_BUTTON_RIGHT)
       buttons |= 0x01;
 
   //------------- cursor movement -------------//
-  mouse_packet_enqueue(report->x, report->y, buttons);
+  if ( TABLET_EMULATION )
+  {
+    // Left, middle, right and back drive puck buttons 1-4
+    uint8_t puck = 0;
+
+    if(usb_buttons & MOUSE_BUTTON_LEFT)
+        puck |= 0x01;
+
+    if(usb_buttons & MOUSE_BUTTON_MIDDLE)
+        puck |= 0x02;
+
+    if(usb_buttons & MOUSE_BUTTON_RIGHT)
+        puck |= 0x04;
+
+    if(usb_buttons & MOUSE_BUTTON_BACKWARD)
+        puck |= 0x08;
+
+    tablet_move(x, y, puck);
+    return;
+  }
+
+  mouse_packet_enqueue(x, y, buttons);
 }
 
 //--------------------------------------------------------------------+
-// Generic Report
+// Digitizer and Absolute Pointer
 //--------------------------------------------------------------------+
-static void process_generic_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
+
+static abs_itf_t* abs_find(uint8_t dev_addr, uint8_t instance)
+{
+  hid_itf_t *itf = hid_find(dev_addr, instance);
+  return (itf && itf->abs.dev_addr) ? &itf->abs : NULL;
+}
+
+static void abs_set_axis(abs_axis_t *axis, hid_field_t const *field, uint16_t index)
+{
+  if ( field->logical_max <= field->logical_min ) return;
+
+  plan_field(&axis->field, field, index, field->logical_min < 0);
+  if ( !axis->field.mask ) return;
+
+  axis->min = field->logical_min;
+  axis->max = field->logical_max;
+  // Rounded up so logical_max reaches TABLET_MAX
+  uint32_t const range = field->logical_max - field->logical_min;
+  axis->scale = (((uint32_t) TABLET_MAX << 16) + range - 1) / range;
+}
+
+// Absolute variable fields of a mouse, pointer or digitizer application
+static bool abs_field_wanted(hid_field_t const *field)
 {
-  (void) dev_addr;
+  if ( field->app_page == HID_USAGE_PAGE_DESKTOP )
+  {
+    if ( field->app_usage != HID_USAGE_DESKTOP_MOUSE && field->app_usage != HID_USAGE_DESKTOP_POINTER ) return false;
+  }
+  else if ( field->app_page != HID_USAGE_PAGE_DIGITIZER ) return false;
 
-  uint8_t const rpt_count = hid_info[instance].report_count;
-  tuh_hid_report_info_t* rpt_info_arr = hid_info[instance].report_info;
-  tuh_hid_report_info_t* rpt_info = NULL;
+  return (field->flags & HID_FIELD_VARIABLE) && !(field->flags & HID_FIELD_RELATIVE);
+}
+
+// Note which reports carry absolute X and Y, the first with both wins
+static void abs_scan_field(hid_field_t const *field, void *ctx)
+{
+  abs_scan_t *scan = (abs_scan_t *) ctx;
+  uint8_t const id = field->report_id;
 
-  if ( rpt_count == 1 && rpt_info_arr[0].report_id == 0)
+  if ( !abs_field_wanted(field) || field->usage_page != HID_USAGE_PAGE_DESKTOP ) return;
+
+  for(uint16_t i=0; i<field->count; i++)
   {
-    // Simple report without report ID as 1st byte
-    rpt_info = &rpt_info_arr[0];
-  }else
+    uint16_t const usage = hid_field_usage(field, i);
+
+    if ( usage == HID_USAGE_DESKTOP_X ) scan->x[id >> 5] |= 1u << (id & 31);
+    if ( usage == HID_USAGE_DESKTOP_Y ) scan->y[id >> 5] |= 1u << (id & 31);
+  }
+
+  if ( scan->report_id < 0 && ((scan->x[id >> 5] & scan->y[id >> 5]) >> (id & 31)) & 1 ) scan->report_id = id;
+}
+
+// Collect X/Y and switches of the report abs_scan_field() picked, the first
+// contact of a multi-touch report
+static void abs_layout_field(hid_field_t const *field, void *ctx)
+{
+  abs_itf_t *abs = (abs_itf_t *) ctx;
+
+  if ( !abs_field_wanted(field) || field->report_id != abs->report_id ) return;
+
+  for(uint16_t i=0; i<field->count; i++)
   {
-    // Composite report, 1st byte is report ID, data starts from 2nd byte
-    uint8_t const rpt_id = report[0];
+    uint16_t const usage = hid_field_usage(field, i);
+    int button = -1;
+
+    if ( field->usage_page == HID_USAGE_PAGE_DESKTOP )
+    {
+      if ( usage == HID_USAGE_DESKTOP_X && !abs->axis[0].field.mask ) abs_set_axis(&abs->axis[0], field, i);
+      if ( usage == HID_USAGE_DESKTOP_Y && !abs->axis[1].field.mask ) abs_set_axis(&abs->axis[1], field, i);
+      continue;
+    }
+
+    if ( field->size != 1 ) continue;
 
-    // Find report id in the array
-    for(uint8_t i=0; i<rpt_count; i++)
+    if ( field->usage_page == HID_USAGE_PAGE_DIGITIZER )
     {
-      if (rpt_id == rpt_info_arr[i].report_id )
+      switch ( usage )
       {
-        rpt_info = &rpt_info_arr[i];
-        break;
+        case 0x32: if ( !abs->in_range.mask ) plan_field(&abs->in_range, field, i, false); break;  // In Range
+        case 0x42: button = 0; break;                                 // Tip Switch
+        case 0x44: button = 1; break;                                 // Barrel Switch
+        case 0x45: button = 2; break;                                 // Eraser
+        case 0x5A: button = 3; break;                                 // Secondary Barrel Switch
+        default: break;
       }
     }
+    else if ( field->usage_page == HID_USAGE_PAGE_BUTTON && usage >= 1 && usage <= 4 )
+    {
+      button = usage - 1;
+    }
+
+    if ( button >= 0 && !abs->button[button].mask ) plan_field(&abs->button[button], field, i, false);
+  }
+}
+
+static uint16_t abs_get_axis(abs_axis_t const *axis, uint8_t const* report)
+{
+  int32_t v = hid_extract(report, &axis->field);
+
+  if ( v < axis->min ) v = axis->min;
+  if ( v > axis->max ) v = axis->max;
+
+  // (max - min) * scale is just over TABLET_MAX << 16, no overflow
+  uint32_t const pos = ((uint32_t) (v - axis->min) * axis->scale) >> 16;
+  return (pos > TABLET_MAX) ? TABLET_MAX : pos;
+}
+
+static void process_abs_report(abs_itf_t *abs, uint8_t const* report)
+{
+  uint8_t buttons = 0;
+
+  // Out of range keeps the last position with every button up
+  if ( hid_extract(report, &abs->in_range) | abs->always_in_range )
+  {
+    abs->x = abs_get_axis(&abs->axis[0], report);
+    // USB digitizers count Y down from the top, the DEC tablet up from the bottom
+    abs->y = TABLET_MAX - abs_get_axis(&abs->axis[1], report);
+
+    // Absent buttons read as 0
+    for(uint8_t i=0; i<4; i++)
+    {
+      buttons |= (hid_extract(report, &abs->button[i]) & 1) << i;
+    }
+  }
+
+  tablet_sample(abs->x, abs->y, buttons);
+}
+
+//--------------------------------------------------------------------+
+// Report Protocol Mouse
+//--------------------------------------------------------------------+
+
+// Collect the relative X/Y, wheel and buttons of the first mouse report
+static void rel_layout_field(hid_field_t const *field, void *ctx)
+{
+  rel_layout_t *rel = (rel_layout_t *) ctx;
+
+  if ( field->app_page != HID_USAGE_PAGE_DESKTOP ) return;
+  if ( field->app_usage != HID_USAGE_DESKTOP_MOUSE && field->app_usage != HID_USAGE_DESKTOP_POINTER ) return;
+  if ( !(field->flags & HID_FIELD_VARIABLE) ) return;
+  if ( rel->fields && field->report_id != rel->report_id ) return;
+
+  for(uint16_t i=0; i<field->count; i++)
+  {
+    uint16_t const usage = hid_field_usage(field, i);
+
+    if ( field->usage_page == HID_USAGE_PAGE_DESKTOP && (field->flags & HID_FIELD_RELATIVE) )
+    {
+      if ( usage == HID_USAGE_DESKTOP_X && !rel->x.mask ) plan_field(&rel->x, field, i, true);
+      if ( usage == HID_USAGE_DESKTOP_Y && !rel->y.mask ) plan_field(&rel->y, field, i, true);
+      if ( usage == HID_USAGE_DESKTOP_WHEEL && !rel->wheel.mask ) plan_field(&rel->wheel, field, i, true);
+    }
+    else if ( field->usage_page == HID_USAGE_PAGE_BUTTON && usage == 1 && field->size == 1 && !rel->buttons.mask )
+    {
+      // Buttons 1-5 as one little bitmap, like the boot report
+      uint16_t const offset = field->bit_offset + i;
+      uint16_t const count = field->count - i;
+      if ( offset / 8 + 4 <= PLAN_REPORT_SIZE ) hid_extract_compile(&rel->buttons, offset, (count < 5) ? count : 5, false);
+    }
+    else continue;
+
+    rel->report_id = field->report_id;
+    rel->fields++;
+  }
+}
+
+static void process_rel_report(rel_layout_t const *rel, uint8_t const* report)
+{
+  int32_t const x = hid_extract(report, &rel->x);
+  int32_t const y = hid_extract(report, &rel->y);
+
+  // Fields are at most 25 bits, keep what fits the motion queue
+  process_mouse_motion((x > INT16_MAX) ? INT16_MAX : (x < INT16_MIN) ? INT16_MIN : x,
+                       (y > INT16_MAX) ? INT16_MAX : (y < INT16_MIN) ? INT16_MIN : y,
+                       hid_extract(report, &rel->buttons));
+}
+
+//--------------------------------------------------------------------+
+// Consumer and System Control
+//--------------------------------------------------------------------+
+
+// Collect the usage array and on/off usages of the first consumer or
+// system control report, ctl->page says which. Bindings are looked up per
+// report, so a keymap change applies to devices already plugged in.
+static void ctl_layout_field(hid_field_t const *field, void *ctx)
+{
+  ctl_layout_t *ctl = (ctl_layout_t *) ctx;
+
+  if ( ctl->page == HID_USAGE_PAGE_CONSUMER )
+  {
+    if ( field->app_page != HID_USAGE_PAGE_CONSUMER || field->app_usage != HID_USAGE_CONSUMER_CONTROL ) return;
+  }
+  else if ( field->app_page != HID_USAGE_PAGE_DESKTOP || field->app_usage != HID_USAGE_DESKTOP_SYSTEM_CONTROL ) return;
+
+  if ( field->usage_page != ctl->page || (field->flags & HID_FIELD_CONSTANT) ) return;
+  if ( ctl->fields && field->report_id != ctl->report_id ) return;
+
+  if ( !(field->flags & HID_FIELD_VARIABLE) )
+  {
+    // One usage array, its values index the usage range or list
+    if ( ctl->array_count || field->size > 16 ) return;
+
+    ctl->array_field = *field;
+
+    for(uint16_t i=0; i<field->count && ctl->array_count<CTL_ARRAY; i++)
+    {
+      hid_extract_t *ex = &ctl->array[ctl->array_count];
+
+      plan_field(ex, field, i, field->logical_min < 0);
+      if ( ex->mask ) ctl->array_count++;
+    }
+  }
+  else if ( field->size == 1 )
+  {
+    // On/off controls, the first CTL_BITS of them
+    for(uint16_t i=0; i<field->count && ctl->bit_count<CTL_BITS; i++)
+    {
+      hid_extract_t *ex = &ctl->bit[ctl->bit_count];
+
+      plan_field(ex, field, i, false);
+      if ( !ex->mask ) continue;
+
+      ctl->bit_usage[ctl->bit_count] = hid_field_usage(field, i);
+      ctl->bit_count++;
+    }
+  }
+  else return;
+
+  ctl->report_id = field->report_id;
+  ctl->fields++;
+}
+
+// Look the usages down up in the bindings and diff the LK201 codes they
+// hold against the last report
+static void process_ctl_report(ctl_layout_t *ctl, uint8_t const* report)
+{
+  uint32_t keys[8] = { 0 };
+
+  for(uint8_t i=0; i<ctl->array_count; i++)
+  {
+    hid_field_t const *field = &ctl->array_field;
+    int32_t const v = hid_extract(report, &ctl->array[i]);
+    if ( v < field->logical_min || v > field->logical_max ) continue;
+
+    uint16_t const usage = hid_field_usage(field, v - field->logical_min);
+    uint8_t const code = usage ? keymap_control(ctl->page, usage) : 0;
+    if ( code ) keys[code >> 5] |= 1u << (code & 31);
+  }
+
+  for(uint8_t i=0; i<ctl->bit_count; i++)
+  {
+    if ( !hid_extract(report, &ctl->bit[i]) ) continue;
+
+    uint8_t const code = keymap_control(ctl->page, ctl->bit_usage[i]);
+    if ( code ) keys[code >> 5] |= 1u << (code & 31);
+  }
+
+  for(uint8_t w=0; w<8; w++)
+  {
+    uint32_t diff = keys[w] ^ ctl->keys[w];
+
+    while ( diff )
+    {
+      uint8_t const bit = __builtin_ctz(diff);
+      diff &= diff - 1;
+
+      keyboard_key((w << 5) | bit, (keys[w] >> bit) & 1);
+    }
+
+    ctl->keys[w] = keys[w];
+  }
+}
 
+//--------------------------------------------------------------------+
+// Generic Report
+//--------------------------------------------------------------------+
+static void process_generic_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
+{
+  hid_itf_t *itf = hid_find(dev_addr, instance);
+  if ( !itf || !itf->plans ) return;
+
+  uint8_t report_id = 0;
+  if ( itf->report_ids )
+  {
+    if ( len == 0 ) return;
+    report_id = report[0];
     report++;
     len--;
   }
 
-  if (!rpt_info)
+  // At most one plan per kind, not per report in the descriptor
+  uint8_t kind = 0;
+  for(uint8_t i=0; i<itf->plans; i++)
   {
-    //printf("Couldn't find the report info for this report !\r\n");
+    if ( itf->plan[i].report_id == report_id ) kind = itf->plan[i].kind;
+  }
+
+  // Keyboards pad for themselves and only when short, the other plans
+  // don't record their span and always get a padded copy
+  if ( kind == 0 ) return;
+  if ( kind == PLAN_KEYBOARD )
+  {
+    process_kbd_layout(&itf->kbd, report, len);
     return;
   }
 
-  // For complete list of Usage Page & Usage checkout src/class/hid/hid.h. For examples:
-  // - Keyboard                     : Desktop, Keyboard
-  // - Mouse                        : Desktop, Mouse
-  // - Gamepad                      : Desktop, Gamepad
-  // - Consumer Control (Media Key) : Consumer, Consumer Control
-  // - System Control (Power key)   : Desktop, System Control
-  // - Generic (vendor)             : 0xFFxx, xx
-  if ( rpt_info->usage_page == HID_USAGE_PAGE_DESKTOP )
+  uint8_t buf[PLAN_REPORT_SIZE];
+  uint8_t const* padded = plan_report(buf, report, len, PLAN_REPORT_SIZE);
+
+  switch ( kind )
   {
-    switch (rpt_info->usage)
-    {
-      case HID_USAGE_DESKTOP_KEYBOARD:
-        //TU_LOG1("HID receive keyboard report\r\n");
-        // Assume keyboard follow boot report layout
-        process_kbd_report( (hid_keyboard_report_t const*) report );
-      break;
-
-      case HID_USAGE_DESKTOP_MOUSE:
-        //TU_LOG1("HID receive mouse report\r\n");
-        // Assume mouse follow boot report layout
-        process_mouse_report( (hid_mouse_report_t const*) report );
-      break;
-
-      default: break;
-    }
+    case PLAN_ABSOLUTE:
+      process_abs_report(&itf->abs, padded);
+    break;
+
+    case PLAN_MOUSE:
+      process_rel_report(&itf->rel, padded);
+    break;
+
+    case PLAN_CONSUMER:
+      process_ctl_report(&itf->consumer, padded);
+    break;
+
+    case PLAN_SYSTEM:
+      process_ctl_report(&itf->system, padded);
+    break;
+
+    default: break;
   }
 }
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <string.h>
+#include <pico/stdlib.h>
+
+#include "hid_parse.h"
+
+// Report IDs tracked for bit offsets within one descriptor
+#define HID_PARSE_REPORTS   (16)
+
+#define HID_ITEM_MAIN       (0)
+#define HID_ITEM_GLOBAL     (1)
+#define HID_ITEM_LOCAL      (2)
+
+#define HID_MAIN_INPUT      (0x8)
+#define HID_MAIN_OUTPUT     (0x9)
+#define HID_MAIN_COLLECTION (0xA)
+#define HID_MAIN_END        (0xC)
+
+#define HID_GLOBAL_PAGE     (0x0)
+#define HID_GLOBAL_LMIN     (0x1)
+#define HID_GLOBAL_LMAX     (0x2)
+#define HID_GLOBAL_SIZE     (0x7)
+#define HID_GLOBAL_ID       (0x8)
+#define HID_GLOBAL_COUNT    (0x9)
+
+#define HID_LOCAL_USAGE     (0x0)
+#define HID_LOCAL_MIN       (0x1)
+#define HID_LOCAL_MAX       (0x2)
+
+#define HID_COLLECTION_APPLICATION (0x01)
+
+static int32_t hid_sign_extend(uint32_t value, uint8_t bytes) {
+    switch(bytes) {
+    case 1:
+        return (int8_t) value;
+    case 2:
+        return (int16_t) value;
+    default:
+        return (int32_t) value;
+    }
+}
+
+// Walk a report descriptor once and hand every field of main item kind to
+// cb. Push/pop and long items are skipped, delimiters are treated as usages.
+static void hid_parse_fields(uint8_t const *desc, uint16_t len, uint8_t kind, hid_field_cb_t cb, void *ctx) {
+    struct {
+        uint8_t id;
+        uint16_t bits;
+    } reports[HID_PARSE_REPORTS];
+    uint8_t nreports = 1;
+    uint8_t cur = 0;
+    uint8_t depth = 0;
+    hid_field_t field;
+    uint16_t pos = 0;
+
+    memset(&field, 0, sizeof(field));
+    reports[0].id = 0;
+    reports[0].bits = 0;
+
+    while(pos < len) {
+        uint8_t prefix = desc[pos++];
+        uint8_t bytes, type, tag;
+        uint32_t data = 0;
+        int i;
+
+        if(prefix == 0xFE) {
+            // Long item, skip the data
+            if(pos + 1 >= len)
+                break;
+            pos += 2 + desc[pos];
+            continue;
+        }
+
+        bytes = prefix & 0x3;
+        if(bytes == 3)
+            bytes = 4;
+        type = (prefix >> 2) & 0x3;
+        tag = prefix >> 4;
+
+        if(pos + bytes > len)
+            break;
+        for(i = 0; i < bytes; i++)
+            data |= (uint32_t) desc[pos + i] << (8 * i);
+        pos += bytes;
+
+        switch(type) {
+        case HID_ITEM_GLOBAL:
+            switch(tag) {
+            case HID_GLOBAL_PAGE:
+                field.usage_page = data;
+                break;
+            case HID_GLOBAL_LMIN:
+                field.logical_min = hid_sign_extend(data, bytes);
+                break;
+            case HID_GLOBAL_LMAX:
+                // Unsigned when the minimum is not negative
+                field.logical_max = (field.logical_min < 0) ? hid_sign_extend(data, bytes) : (int32_t) data;
+                break;
+            case HID_GLOBAL_SIZE:
+                field.size = data;
+                break;
+            case HID_GLOBAL_COUNT:
+                field.count = data;
+                break;
+            case HID_GLOBAL_ID:
+                for(cur = 0; cur < nreports; cur++)
+                    if(reports[cur].id == data)
+                        break;
+                if(cur == nreports) {
+                    if(nreports == HID_PARSE_REPORTS)
+                        return;
+                    reports[nreports].id = data;
+                    reports[nreports].bits = 0;
+                    nreports++;
+                }
+                field.report_id = data;
+                break;
+            }
+            break;
+
+        case HID_ITEM_LOCAL:
+            switch(tag) {
+            case HID_LOCAL_USAGE:
+                if(field.usage_count < HID_PARSE_USAGES)
+                    field.usages[field.usage_count++] = data;
+                break;
+            case HID_LOCAL_MIN:
+                field.usage_min = data;
+                break;
+            case HID_LOCAL_MAX:
+                field.usage_max = data;
+                break;
+            }
+            break;
+
+        case HID_ITEM_MAIN:
+            switch(tag) {
+            case HID_MAIN_COLLECTION:
+                if((depth == 0) && (data == HID_COLLECTION_APPLICATION)) {
+                    field.app_page = field.usage_page;
+                    field.app_usage = field.usage_count ? field.usages[0] : field.usage_min;
+                }
+                depth++;
+                break;
+            case HID_MAIN_END:
+                if(depth)
+                    depth--;
+                break;
+            case HID_MAIN_INPUT:
+            case HID_MAIN_OUTPUT:
+                // Input and output reports each have their own layout
+                if(tag != kind)
+                    break;
+                field.flags = data;
+                field.bit_offset = reports[cur].bits;
+                reports[cur].bits += field.size * field.count;
+                if(!(field.flags & HID_FIELD_CONSTANT))
+                    cb(&field, ctx);
+                break;
+            }
+
+            // Local items only apply to the main item they precede
+            field.usage_count = 0;
+            field.usage_min = 0;
+            field.usage_max = 0;
+            break;
+        }
+    }
+}
+
+// Fields too wide for a single word load are left absent
+void hid_extract_compile(hid_extract_t *ex, uint16_t offset, uint8_t size, bool is_signed) {
+    ex->byte = offset >> 3;
+    ex->shift = offset & 7;
+    ex->mask = 0;
+    ex->sign = 0;
+
+    if((size == 0) || (size > HID_EXTRACT_BITS))
+        return;
+
+    ex->mask = (1u << size) - 1;
+    if(is_signed && (size > 1))
+        ex->sign = 1u << (size - 1);
+}
+
+// Constant time and branch free, report must have HID_EXTRACT_PAD bytes
+// of padding after the field
+int32_t hid_extract(uint8_t const *report, hid_extract_t const *ex) {
+    uint8_t const *p = report + ex->byte;
+    uint32_t value = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+
+    value = (value >> ex->shift) & ex->mask;
+
+    // Sign extend, a no-op when sign is 0
+    return (int32_t) ((value ^ ex->sign) - ex->sign);
+}
+
+void hid_parse_inputs(uint8_t const *desc, uint16_t len, hid_field_cb_t cb, void *ctx) {
+    hid_parse_fields(desc, len, HID_MAIN_INPUT, cb, ctx);
+}
+
+void hid_parse_outputs(uint8_t const *desc, uint16_t len, hid_field_cb_t cb, void *ctx) {
+    hid_parse_fields(desc, len, HID_MAIN_OUTPUT, cb, ctx);
+}
+
+// Usage of element index, a short usage list repeats its last entry
+uint16_t hid_field_usage(hid_field_t const *field, uint16_t index) {
+    if(field->usage_count)
+        return field->usages[(index < field->usage_count) ? index : field->usage_count - 1];
+
+    if(field->usage_min + index > field->usage_max)
+        return field->usage_max;
+
+    return field->usage_min + index;
+}
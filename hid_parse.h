@@ -0,0 +1,56 @@
+#ifndef __HID_PARSE_H
+#define __HID_PARSE_H
+
+// Usages remembered per field when listed one by one instead of as a range
+#define HID_PARSE_USAGES  (8)
+
+// Input main item flags
+#define HID_FIELD_CONSTANT  (0x01)
+#define HID_FIELD_VARIABLE  (0x02)
+#define HID_FIELD_RELATIVE  (0x04)
+
+typedef struct hid_field_s {
+    uint8_t report_id;
+    uint16_t bit_offset;    // from the first data byte, after any report ID
+    uint8_t size;           // bits per element
+    uint16_t count;         // elements
+    uint8_t flags;
+
+    uint16_t usage_page;
+    uint16_t usage_min;
+    uint16_t usage_max;
+    uint16_t usages[HID_PARSE_USAGES];
+    uint8_t usage_count;    // 0 when the field uses usage_min..usage_max
+
+    int32_t logical_min;
+    int32_t logical_max;
+
+    uint16_t app_page;      // enclosing application collection
+    uint16_t app_usage;
+} hid_field_t;
+
+// Bytes past the end of a report hid_extract() may read, reports are
+// copied into a buffer with this much zeroed padding first
+#define HID_EXTRACT_PAD     (4)
+
+// Widest field hid_extract() reads, it builds one 32 bit word from four
+// byte loads so the field can start at any byte on the M0+
+#define HID_EXTRACT_BITS    (25)
+
+// A field compiled at mount for hid_extract(), all zero reads as 0
+typedef struct hid_extract_s {
+    uint16_t byte;          // first byte holding the field
+    uint8_t shift;          // bit of the field within that byte
+    uint32_t mask;          // 0 for an absent field
+    uint32_t sign;          // sign bit of a signed field, otherwise 0
+} hid_extract_t;
+
+typedef void (*hid_field_cb_t)(hid_field_t const *field, void *ctx);
+
+extern void hid_parse_inputs(uint8_t const *desc, uint16_t len, hid_field_cb_t cb, void *ctx);
+extern void hid_parse_outputs(uint8_t const *desc, uint16_t len, hid_field_cb_t cb, void *ctx);
+extern uint16_t hid_field_usage(hid_field_t const *field, uint16_t index);
+extern void hid_extract_compile(hid_extract_t *ex, uint16_t offset, uint8_t size, bool is_signed);
+extern int32_t hid_extract(uint8_t const *report, hid_extract_t const *ex);
+
+#endif /* __HID_PARSE_H */
\ No newline at end of file
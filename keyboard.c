@@ -1,8 +1,15 @@
 #include <stdio.h>
 #include <pico/stdlib.h>
-#include <hardware/pwm.h>
+#include <hardware/sync.h>
+#include <hardware/irq.h>
+#include <hardware/timer.h>
 #include "bsp/board.h"
 
+#include "audio.h"
+#ifdef KEYBOARD_BENCHMARK
+#include <hardware/structs/systick.h>
+#endif
+
 #define KBD_ALL_UPS     (0xB3)
 #define KBD_METRONOME   (0xB4)
 #define KBD_OUTPUT_ERR  (0xB5)
@@ -12,6 +19,7 @@
 #define KBD_PREFIX      (0xB9)
 #define KBD_CHMODE_ACK  (0xBA)
 #define KBD_RESERVED    (0x7F)
+#define KBD_SHIFT       (0xAE)
 
 #define KBD_FWID     (0x01)
 #define KBD_HWID     (0x00)
@@ -37,6 +45,27 @@
 #define FDM_AUTO	(1)
 #define FDM_DNUP	(3)
 
+// Key events published by the USB side, must be a power of two
+#define KBD_EVENT_QUEUE (64)
+#define KBD_EVENT_DOWN  (0x100)
+
+// Host command bytes buffered by the UART IRQ, must be a power of two
+#define KBD_RX_QUEUE    (32)
+
+// Bytes waiting for the UART TX interrupt, must be a power of two
+#define KBD_TX_QUEUE    (128)
+
+// Key output held while the host has inhibited transmission
+#define KBD_HOLD_SIZE   (16)
+
+// Peripheral command table index, the high bit only flags the last byte
+#define LK_PERIPH(c)    (((c) & 0x7F) >> 1)
+
+// Key state bitsets, one bit per LK201 code
+#define KBD_WORDS       (256 / 32)
+#define KBD_BIT(c)      (1u << ((c) & 31))
+#define KBD_WORD(c)     ((c) >> 5)
+
 typedef struct divstate_s {
     uint8_t mode;
     uint8_t arbuf;
@@ -44,14 +73,24 @@ typedef struct divstate_s {
 } divstate_t;
 
 typedef struct arbuf_s {
-    uint16_t timeout;
-    uint16_t interval;
+    uint32_t timeout;   // us
+    uint32_t interval;  // us
 } arbuf_t;
 
 divstate_t divstate[16];
 arbuf_t arbuf[4];
-bool keystate[256];
-bool keys[256];
+static volatile uint32_t keystate[KBD_WORDS];  // USB side (core0)
+static volatile uint32_t keystate_seq;
+static uint8_t keyrefs[256];                    // USB keys holding each code (core0)
+static int shift_force = -1;                    // Shift forced up (0) or down (1) (core0)
+static int shift_forcer = -1;                   // Code the shift is forced for (core0)
+static uint32_t keys[KBD_WORDS];                // Reported to the host (core1)
+static uint32_t autokeys[KBD_WORDS];            // Keys in auto-repeat divisions
+static uint32_t dnupkeys[KBD_WORDS];            // Keys in down/up divisions
+static uint16_t kbd_events[KBD_EVENT_QUEUE];
+static volatile uint8_t kbd_ev_wrptr;
+static volatile uint8_t kbd_ev_rdptr;
+static volatile bool kbd_ev_overflow;
 bool ledstate[4];
 uint8_t autoinhibit;
 bool inhibit;
@@ -60,28 +99,199 @@ uint8_t keyclick_volume;
 uint8_t bell_volume;
 uint8_t cmd_param[4];
 uint8_t cmd_pos;
-uint audio_slice;
-uint audio_chan;
+static uint8_t kbd_rxbuf[KBD_RX_QUEUE];
+static volatile uint8_t kbd_rx_wrptr;
+static volatile uint8_t kbd_rx_rdptr;
+static volatile uint32_t kbd_rx_stamp;
+volatile uint32_t kbd_rx_overruns;     // Bytes lost to a full ring or UART error
+uint32_t kbd_rx_latency_max;           // Worst RX FIFO to command execution time, us
+static uint8_t kbd_txbuf[KBD_TX_QUEUE];
+static volatile uint8_t kbd_tx_wrptr;
+static volatile uint8_t kbd_tx_rdptr;
+uint32_t kbd_tx_highwater;             // Most bytes ever waiting to transmit
+uint32_t kbd_tx_drops;                 // Bytes discarded with the queue full
+static uint8_t kbd_tx_last;
+static uint8_t kbd_hold[KBD_HOLD_SIZE];
+static uint8_t kbd_hold_count;
+static uint ar_alarm;
+static volatile int arcode=-1;
+static uint64_t ar_next;
+
+// Function division of every LK201 code, FD_MAIN unless listed
+static const uint8_t funcdiv[256] = {
+    [0x00 ... 0xFF] = FD_MAIN,
+    [0x56 ... 0x5A] = FD_FA,
+    [0x64 ... 0x68] = FD_FB,
+    [0x71 ... 0x74] = FD_FC,
+    [0x7C ... 0x7D] = FD_FD,
+    [0x80 ... 0x83] = FD_FE,
+    [0x8A ... 0x8F] = FD_EDITING,
+    [0x92]          = FD_NUMPAD,
+    [0x94 ... 0xA4] = FD_NUMPAD,
+    [0xA7 ... 0xA8] = FD_HCURSOR,
+    [0xA9 ... 0xAA] = FD_VCURSOR,
+    [0xAE ... 0xAF] = FD_SHIFT,
+    [0xB0 ... 0xB1] = FD_LOCK,
+    [0xBC]          = FD_DELETE,
+    [0xBD ... 0xBE] = FD_RETURN,
+};
+
+// Move queued bytes into the TX FIFO. The TX interrupt only fires as the
+// FIFO drains past its trigger level, so the FIFO is primed from here and
+// the interrupt left on while bytes are still waiting. Interrupts off.
+static void keyboard_tx_fill() {
+    while((kbd_tx_rdptr != kbd_tx_wrptr) && uart_is_writable(uart0)) {
+        uart_get_hw(uart0)->dr = kbd_txbuf[kbd_tx_rdptr & (KBD_TX_QUEUE - 1)];
+        kbd_tx_rdptr++;
+    }
 
-static int64_t keyboard_silence_callback(alarm_id_t id, void *user_data) {
-    pwm_set_chan_level(audio_slice, audio_chan, 0);
-    return 0;
+    if(kbd_tx_rdptr == kbd_tx_wrptr)
+        hw_clear_bits(&uart_get_hw(uart0)->imsc, UART_UARTIMSC_TXIM_BITS);
+    else
+        hw_set_bits(&uart_get_hw(uart0)->imsc, UART_UARTIMSC_TXIM_BITS);
+}
+
+// Queue a byte for the host without blocking, the TX interrupt sends it.
+// Also called from the auto-repeat alarm, so it runs with interrupts off.
+static bool keyboard_putc(uint8_t c) {
+    uint32_t save = save_and_disable_interrupts();
+    uint8_t used = kbd_tx_wrptr - kbd_tx_rdptr;
+
+    if(used >= KBD_TX_QUEUE) {
+        kbd_tx_drops++;
+        restore_interrupts(save);
+        return false;
+    }
+
+    kbd_txbuf[kbd_tx_wrptr & (KBD_TX_QUEUE - 1)] = c;
+    kbd_tx_wrptr++;
+    kbd_tx_last = c;
+
+    if(used + 1u > kbd_tx_highwater)
+        kbd_tx_highwater = used + 1u;
+
+    keyboard_tx_fill();
+    restore_interrupts(save);
+    return true;
+}
+
+// Key output goes to the hold buffer while inhibited. Like the LK201,
+// the last slot becomes an output error once it fills, later keys are lost.
+static void keyboard_sendkey(uint8_t c) {
+    if(!inhibit) {
+        keyboard_putc(c);
+        return;
+    }
+
+    if(kbd_hold_count < KBD_HOLD_SIZE - 1) {
+        kbd_hold[kbd_hold_count++] = c;
+    } else if(kbd_hold_count == KBD_HOLD_SIZE - 1) {
+        kbd_hold[kbd_hold_count++] = KBD_OUTPUT_ERR;
+    }
+}
+
+static void keyboard_hold_flush() {
+    int i;
+
+    for(i = 0; i < kbd_hold_count; i++)
+        keyboard_putc(kbd_hold[i]);
+    kbd_hold_count = 0;
+}
+
+// Arm the repeat alarm for ar_next, skipping ticks that are already late.
+static void keyboard_ar_arm() {
+    uint32_t interval = arbuf[divstate[funcdiv[arcode]].arbuf].interval;
+
+    while(hardware_alarm_set_target(ar_alarm, from_us_since_boot(ar_next)))
+        ar_next += interval;
+}
+
+static void keyboard_ar_callback(uint alarm) {
+    int code = arcode;
+
+    if((code == -1) || autoinhibit)
+        return;
+
+    // The key itself is only resent if something else went out in between.
+    // Repeats are not held while the host has inhibited transmission.
+    if(!inhibit) {
+        if((kbd_tx_last == code) || (kbd_tx_last == KBD_METRONOME))
+            keyboard_putc(KBD_METRONOME);
+        else
+            keyboard_putc(code);
+    }
+
+    ar_next += arbuf[divstate[funcdiv[code]].arbuf].interval;
+    keyboard_ar_arm();
+}
+
+static void keyboard_ar_start(uint8_t code) {
+    uint32_t save = save_and_disable_interrupts();
+
+    hardware_alarm_cancel(ar_alarm);
+    arcode = code;
+    if(!autoinhibit) {
+        ar_next = time_us_64() + arbuf[divstate[funcdiv[code]].arbuf].timeout;
+        keyboard_ar_arm();
+    }
+    restore_interrupts(save);
+}
+
+static void keyboard_ar_stop() {
+    uint32_t save = save_and_disable_interrupts();
+
+    hardware_alarm_cancel(ar_alarm);
+    arcode = -1;
+    restore_interrupts(save);
+}
+
+// Repeat the highest auto-repeating key still held, if any
+static void keyboard_ar_held() {
+    uint32_t bits;
+    int i;
+
+    for(i = KBD_WORDS - 1; i >= 0; i--) {
+        bits = keys[i] & autokeys[i];
+        if(bits) {
+            keyboard_ar_start((i << 5) | (31 - __builtin_clz(bits)));
+            break;
+        }
+    }
 }
 
 void keyboard_sound(uint ms) {
-    uint vol;
-    
     if(ms == 0) {
-        pwm_set_chan_level(audio_slice, audio_chan, 0);
-        return;
+        audio_silence();
     } else if(ms == 2) {
-        vol = keyclick_volume * 36;
+        audio_play(AUDIO_CLICK, keyclick_volume, 2000);
     } else {
-        vol = bell_volume * 36;
+        audio_play(AUDIO_BELL, bell_volume, ms * 1000);
+    }
+}
+
+// Rebuild the auto-repeat and down/up masks after a division mode change
+static void keyboard_divmasks() {
+    int i;
+
+    for(i = 0; i < KBD_WORDS; i++) {
+        autokeys[i] = 0;
+        dnupkeys[i] = 0;
     }
 
-    pwm_set_chan_level(audio_slice, audio_chan, vol);
-    add_alarm_in_ms(ms, keyboard_silence_callback, NULL, false);
+    for(i = 0; i < 256; i++) {
+        if(divstate[funcdiv[i]].mode == FDM_AUTO)
+            autokeys[KBD_WORD(i)] |= KBD_BIT(i);
+        else if(divstate[funcdiv[i]].mode == FDM_DNUP)
+            dnupkeys[KBD_WORD(i)] |= KBD_BIT(i);
+    }
+}
+
+static void keyboard_release_all() {
+    int i;
+
+    for(i = 0; i < KBD_WORDS; i++)
+        keys[i] = 0;
+    keyboard_ar_stop();
 }
 
 static void keyboard_defaults() {
@@ -92,6 +302,7 @@ static void keyboard_defaults() {
     ctrlclick = false;
     autoinhibit = 0;
     inhibit = false;
+    kbd_hold_count = 0;
 
     divstate[1].mode = FDM_AUTO;  // Graphic Keys, Spacebar (ASCII 0x20 - 0x7E)
     divstate[1].click = true;
@@ -137,18 +348,18 @@ static void keyboard_defaults() {
     divstate[14].mode = FDM_AUTO; // Function Keys (G20-G23)
     divstate[14].click = true;
 
-    arbuf[0].timeout = 500;
-    arbuf[0].interval = 1000/30;
-    arbuf[1].timeout = 300;
-    arbuf[1].interval = 1000/30;
-    arbuf[2].timeout = 500;
-    arbuf[2].interval = 1000/40;
-    arbuf[3].timeout = 300;
-    arbuf[3].interval = 1000/40;
-
-    for(i = 0; i < 256; i++)
-        keystate[i] = false;
-    
+    arbuf[0].timeout = 500000;
+    arbuf[0].interval = 1000000/30;
+    arbuf[1].timeout = 300000;
+    arbuf[1].interval = 1000000/30;
+    arbuf[2].timeout = 500000;
+    arbuf[2].interval = 1000000/40;
+    arbuf[3].timeout = 300000;
+    arbuf[3].interval = 1000000/40;
+
+    keyboard_divmasks();
+    keyboard_release_all();
+
     for(i = 0; i < 4; i++)
         ledstate[i] = false;
     
@@ -158,10 +369,10 @@ static void keyboard_defaults() {
 static void keyboard_selftest() {
     keyboard_defaults();
 
-    uart_putc_raw(uart0, KBD_FWID); // Firmware ID
-    uart_putc_raw(uart0, KBD_HWID); // Hardware ID
-    uart_putc_raw(uart0, 0x00);     // No Error
-    uart_putc_raw(uart0, 0x00);     // No Keycode
+    keyboard_putc(KBD_FWID); // Firmware ID
+    keyboard_putc(KBD_HWID); // Hardware ID
+    keyboard_putc(0x00);     // No Error
+    keyboard_putc(0x00);     // No Keycode
 }
 
 static int64_t keyboard_selftest_callback(alarm_id_t id, void *user_data) {
@@ -169,273 +380,238 @@ static int64_t keyboard_selftest_callback(alarm_id_t id, void *user_data) {
     return 0;
 }
 
-static void keyboard_parsecmd() {
+typedef void (*kbd_cmd_t)(const uint8_t *param, uint8_t nparam);
+
+static void kbd_cmd_resume(const uint8_t *param, uint8_t nparam) {
+    ledstate[1] = false;
+    inhibit = false;
+    keyboard_hold_flush();
+}
+
+static void kbd_cmd_inhibit(const uint8_t *param, uint8_t nparam) {
+    ledstate[1] = true;
+    inhibit = true;
+    keyboard_putc(KBD_LOCK_ACK);
+}
+
+static void kbd_cmd_leds_on(const uint8_t *param, uint8_t nparam) {
+    int i;
+
+    for(i = 0; nparam && (i < 4); i++)
+        if(param[0] & (1 << i))
+            ledstate[i] = true;
+}
+
+static void kbd_cmd_leds_off(const uint8_t *param, uint8_t nparam) {
+    int i;
+
+    for(i = 0; nparam && (i < 4); i++)
+        if(param[0] & (1 << i))
+            ledstate[i] = false;
+}
+
+static void kbd_cmd_click_off(const uint8_t *param, uint8_t nparam) {
+    keyclick_volume = 0;
+}
+
+static void kbd_cmd_click_on(const uint8_t *param, uint8_t nparam) {
+    keyclick_volume = 7 - ((nparam ? param[0] : 0) & 7);
+}
+
+static void kbd_cmd_ctrlclick_off(const uint8_t *param, uint8_t nparam) {
+    ctrlclick = false;
+}
+
+static void kbd_cmd_ctrlclick_on(const uint8_t *param, uint8_t nparam) {
+    ctrlclick = true;
+}
+
+static void kbd_cmd_click(const uint8_t *param, uint8_t nparam) {
+    keyboard_sound(2);
+}
+
+static void kbd_cmd_bell_off(const uint8_t *param, uint8_t nparam) {
+    bell_volume = 0;
+}
+
+static void kbd_cmd_bell_on(const uint8_t *param, uint8_t nparam) {
+    bell_volume = 7 - ((nparam ? param[0] : 0) & 7);
+}
+
+static void kbd_cmd_bell(const uint8_t *param, uint8_t nparam) {
+    keyboard_sound(125);
+}
+
+static void kbd_cmd_ar_temp_off(const uint8_t *param, uint8_t nparam) {
+    // Stops the key repeating now, the next keystroke lifts it
+    autoinhibit = 1;
+    hardware_alarm_cancel(ar_alarm);
+}
+
+static void kbd_cmd_ar_on(const uint8_t *param, uint8_t nparam) {
+    if(!autoinhibit)
+        return;
+    autoinhibit = 0;
+
+    // A key already held starts repeating without being pressed again
+    keyboard_ar_stop();
+    keyboard_ar_held();
+}
+
+static void kbd_cmd_ar_off(const uint8_t *param, uint8_t nparam) {
+    autoinhibit = 2;
+    hardware_alarm_cancel(ar_alarm);
+}
+
+static void kbd_cmd_ar_downonly(const uint8_t *param, uint8_t nparam) {
     int i;
 
+    for(i = 1; i < 16; i++)
+        if(divstate[i].mode == FDM_AUTO)
+            divstate[i].mode = FDM_DOWN;
+
+    keyboard_divmasks();
+    keyboard_ar_stop();
+}
+
+static void kbd_cmd_id(const uint8_t *param, uint8_t nparam) {
+    keyboard_putc(KBD_FWID); // Firmware ID
+    keyboard_putc(KBD_HWID); // Hardware ID
+}
+
+static void kbd_cmd_powerup(const uint8_t *param, uint8_t nparam) {
+    keyboard_selftest();
+}
+
+static void kbd_cmd_testmode(const uint8_t *param, uint8_t nparam) {
+}
+
+static void kbd_cmd_defaults(const uint8_t *param, uint8_t nparam) {
+    keyboard_defaults();
+}
+
+static const kbd_cmd_t kbd_periph_cmds[64] = {
+    [LK_PERIPH(0x8B)] = kbd_cmd_resume,         // Resume Keyboard Transmission
+    [LK_PERIPH(0x89)] = kbd_cmd_inhibit,        // Inhibit Keyboard Transmission
+    [LK_PERIPH(0x13)] = kbd_cmd_leds_on,        // Turn on LEDs
+    [LK_PERIPH(0x11)] = kbd_cmd_leds_off,       // Turn off LEDs
+    [LK_PERIPH(0x99)] = kbd_cmd_click_off,      // Disable Keyclick
+    [LK_PERIPH(0x1B)] = kbd_cmd_click_on,       // Enable Keyclick, Set Volume
+    [LK_PERIPH(0xB9)] = kbd_cmd_ctrlclick_off,  // Disable Ctrl Keyclick
+    [LK_PERIPH(0xBB)] = kbd_cmd_ctrlclick_on,   // Enable Ctrl Keyclick
+    [LK_PERIPH(0x9F)] = kbd_cmd_click,          // Sound Keyclick
+    [LK_PERIPH(0xA1)] = kbd_cmd_bell_off,       // Disable Bell
+    [LK_PERIPH(0x23)] = kbd_cmd_bell_on,        // Enable Bell, Set Volume
+    [LK_PERIPH(0xA7)] = kbd_cmd_bell,           // Sound Bell
+    [LK_PERIPH(0xC1)] = kbd_cmd_ar_temp_off,    // Temporary Auto-Repeat Inhibit
+    [LK_PERIPH(0xE3)] = kbd_cmd_ar_on,          // Enable Auto-Repeat Across Keyboard
+    [LK_PERIPH(0xE1)] = kbd_cmd_ar_off,         // Disable Auto-Repeat Across Keyboard
+    [LK_PERIPH(0xD9)] = kbd_cmd_ar_downonly,    // Change All Auto-Repeat to Down-Only
+    [LK_PERIPH(0xAB)] = kbd_cmd_id,             // Request Keyboard ID
+    [LK_PERIPH(0xFD)] = kbd_cmd_powerup,        // Jump to Power-Up
+    [LK_PERIPH(0xCB)] = kbd_cmd_testmode,       // Jump to Test Mode
+    [LK_PERIPH(0xD3)] = kbd_cmd_defaults,       // Reinstate Defaults
+};
+
+static void keyboard_divcmd() {
+    uint div = (cmd_param[0] >> 3) & 0xF;
+    uint mode = (cmd_param[0] >> 1) & 0x3;
+
+    if(div == 0x0) {
+        // Invalid command
+        return;
+    }
+
+    if(div == 0xF) {
+        // Set Auto-Repeat Buffer Parameters: buffer in the mode bits,
+        // timeout in 5ms units then rate in repeats per second.
+        if((cmd_pos == 2) && (cmd_param[2] & 0x7F)) {
+            arbuf[mode].timeout = (cmd_param[1] & 0x7F) * 5000;
+            arbuf[mode].interval = 1000000 / (cmd_param[2] & 0x7F);
+        }
+        return;
+    }
+
+    // Select division mode and optionally auto-repeat buffer
+    if(cmd_pos) {
+        divstate[div].arbuf = cmd_param[1] & 0x3;
+    }
+    if(mode != 2) {
+        divstate[div].mode = mode;
+        keyboard_divmasks();
+        if((arcode != -1) && (funcdiv[arcode] == div) && (mode != FDM_AUTO))
+            keyboard_ar_stop();
+    }
+}
+
+static void keyboard_parsecmd() {
+    kbd_cmd_t cmd;
+
     // Ignore extra-long commands
     if(cmd_pos >= 3) return;
 
     if(cmd_param[0] & 1) {
-        switch(cmd_param[0]) {
-            case 0x8B: // Resume Keyboard Transmission
-                ledstate[1] = false;
-                inhibit = false;
-                break;
-            case 0x89: // Inhibit Keyboard Transmission
-                ledstate[1] = true;
-                inhibit = true;
-                uart_putc_raw(uart0, KBD_LOCK_ACK);
-                break;
-            case 0x13: // Turn on LEDs
-                for(i = 0; i < 4; i++)
-                    if(cmd_param[1] & (1 << i))
-                        ledstate[i] = false;
-                break;
-            case 0x11: // Turn off LEDs
-                for(i = 0; i < 4; i++)
-                    if(cmd_param[1] & (1 << i))
-                        ledstate[i] = true;
-                break;
-            case 0x99: // Disable Keyclick
-                keyclick_volume = 0;
-                break;
-            case 0x1B: // Enable Keyclick, Set Volume
-                keyclick_volume = 7 - (cmd_param[1] & 7);
-                break;
-            case 0xB9: // Disable Ctrl Keyclick
-                ctrlclick = false;
-                break;
-            case 0xBB: // Enable Ctrl Keyclick
-                ctrlclick = true;
-                break;
-            case 0x9F: // Sound Keyclick
-                keyboard_sound(2);
-                break;
-            case 0xA1: // Disable Bell
-                bell_volume = 0;
-                break;
-            case 0x23: // Enable Bell, Set Volume
-                bell_volume = 7 - (cmd_param[1] & 7);
-                break;
-            case 0xA7: // Sound Bell
-                keyboard_sound(125);
-                break;
-            case 0xC1: // Temporary Auto-Repeat Inhibit
-                autoinhibit = 1;
-                break;
-            case 0xE3: // Enable Auto-Repeat Across Keyboard
-                autoinhibit = 0;
-                break;
-            case 0xE1: // Disable Auto-Repeat Across Keyboard
-                autoinhibit = 2;
-                break;
-            case 0xD9: // Change All Auto-Repeat to Down-Only
-                break;
-            case 0xAB: // Request Keyboard ID
-                uart_putc_raw(uart0, KBD_FWID); // Firmware ID
-                uart_putc_raw(uart0, KBD_HWID); // Hardware ID
-                break;
-            case 0xFD: // Jump to Power-Up
-                keyboard_selftest();
-                break;
-            case 0xCB: // Jump to Test Mode
-                break;
-            case 0xD3: // Reinstate Defaults
-                keyboard_defaults();
-                break;
-        }
+        cmd = kbd_periph_cmds[LK_PERIPH(cmd_param[0])];
+        if(cmd)
+            cmd(&cmd_param[1], cmd_pos);
+        else
+            keyboard_putc(KBD_INPUT_ERR);
     } else {
-        uint div = (cmd_param[0] >> 3) & 0xF;
-        uint mode = (cmd_param[0] >> 1) & 0x3;
+        keyboard_divcmd();
+    }
+}
 
-        if(div == 0x0) {
-            // Invalid command
-            return;
-        }
+// Move whatever the RX FIFO holds into the queue, interrupts off on core1
+static void keyboard_rx_fifo() {
+    uint32_t dr;
+    uint8_t next;
 
-        if(div == 0xF) {
-            // Set Auto-Repeat Buffer Parameters
-            return;
-        }
+    while(uart_is_readable(uart0)) {
+        dr = uart_get_hw(uart0)->dr;
+        next = kbd_rx_wrptr + 1;
 
-        // Select division mode and optionally auto-repeat buffer
-        if(cmd_pos) {
-            divstate[div].arbuf = cmd_param[1];
-        }
-        if(mode != 2) {
-            divstate[div].mode = mode;
+        if((dr & (UART_UARTDR_OE_BITS | UART_UARTDR_BE_BITS | UART_UARTDR_FE_BITS)) ||
+           (((next ^ kbd_rx_rdptr) & (KBD_RX_QUEUE - 1)) == 0)) {
+            kbd_rx_overruns++;
+            continue;
         }
+
+        if(kbd_rx_wrptr == kbd_rx_rdptr)
+            kbd_rx_stamp = time_us_32();
+
+        kbd_rxbuf[kbd_rx_wrptr & (KBD_RX_QUEUE - 1)] = dr;
+        kbd_rx_wrptr = next;
     }
 }
 
-static int map_funcdiv( uint8_t s )
-{
-	switch ( s )
-	{
-		case 0x92:
-		case 0x94:
-		case 0x95:
-		case 0x96:
-		case 0x97:
-		case 0x98:
-		case 0x99:
-		case 0x9A:
-		case 0x9B:
-		case 0x9C:
-		case 0x9D:
-		case 0x9E:
-		case 0x9F:
-		case 0xA1:
-		case 0xA2:
-		case 0xA3:
-		case 0xA4:
-			return 2;
-		case 0xBC:
-			return 3;
-		case 0xBD:
-		case 0xBE:
-			return 4;
-		case 0xB0:
-		case 0xB1:
-			return 5;
-		case 0xAF:
-		case 0xAE:
-			return 6;
-		case 0xA7:
-		case 0xA8:
-			return 7;
-		case 0xA9:
-		case 0xAA:
-			return 8;
-		case 0x8A:
-		case 0x8B:
-		case 0x8C:
-		case 0x8D:
-		case 0x8E:
-		case 0x8F:
-			return 9;
-		case 0x56:
-		case 0x57:
-		case 0x58:
-		case 0x59:
-		case 0x5A:
-			return 10;
-		case 0x64:
-		case 0x65:
-		case 0x66:
-		case 0x67:
-		case 0x68:
-			return 11;
-		case 0x71:
-		case 0x72:
-		case 0x73:
-		case 0x74:
-			return 12;
-		case 0x7C:
-		case 0x7D:
-			return 13;
-		case 0x80:
-		case 0x81:
-		case 0x82:
-		case 0x83:
-			return 14;
-		default:
-			return 1;
-	}
+// Runs on core1 with the FIFOs on. RX interrupts at its level or on the
+// receive timeout, TX once its FIFO has drained to 1/8.
+static void keyboard_uart_irq() {
+    keyboard_tx_fill();
+    keyboard_rx_fifo();
 }
 
-int arcode=-1;
-uint8_t dur[10];
-int durp=0;
-unsigned long arstart;
+// Run every buffered host byte through the command parser
+static void keyboard_rxdrain() {
+    uint32_t save = save_and_disable_interrupts();
+    uint32_t latency;
 
-static void keyboard_scan() {
-	static int artimer = 0;
-	static int lastar = -1;
-	unsigned long nows = board_millis();
-	unsigned long arn;
-	static int nextar;
-
-	int i = 0;
-	int fd, arr= 0, ks=0,dua=0;
-	durp=0;
-	/* Scan keys */
-	for ( i = 0; i < 256; i++ ) {
-		fd = map_funcdiv( i );
-		if ( keystate[i] && !keys[i] ) {
-			keyboard_sound(2);
-
-			if ( divstate[fd].mode == FDM_AUTO ) {
-				arcode = i;
-				arstart = nows + arbuf[divstate[fd].arbuf].timeout;
-			} else {
-				ks = 1;
-			}
-
-			if ( divstate[fd].mode == FDM_DNUP )
-				dua = 1;
-			uart_putc_raw(uart0, i );
-			keys[i] = true;
-		} else if ( keystate[i] && keys[i] ) {
-			if ( divstate[fd].mode == FDM_DNUP )
-				dua = 1;
-		} else if ( keys[i] && !keystate[i] ) {
-			if ( arcode == i ) {
-				arr = 1;
-				arcode = -1;
-			}
-
-			if ( divstate[fd].mode == FDM_DNUP ) {
-				/* Check for all ups */
-				dur[durp++] = i;
-			}
-			keys[i] = false;
-		}
-	}
-	
-	/* If downup released and all ups */
-	if ( durp && !dua) {
-		uart_putc_raw(uart0, KBD_ALL_UPS );
-		ks = 1;
-	} else if ( durp ) {
-		for ( i = 0; i < durp; i++)
-			uart_putc_raw(uart0, dur[i]);
-		ks = 1;
-	}
+    // Polled too, so a byte waits one pass here rather than the 32 bit
+    // time receive timeout before the IRQ would take it
+    keyboard_rx_fifo();
+    restore_interrupts(save);
 
-	if ( arr ) {
-		for ( i = 0; i < 256; i++ ) {
-			fd = map_funcdiv( i );
-			if (  (divstate[fd].mode == FDM_AUTO) && keys[i] ) {
-				arcode = i;
-				arstart = nows + arbuf[divstate[fd].arbuf].timeout;
-			}
-		}
-	}
+    if(kbd_rx_rdptr == kbd_rx_wrptr)
+        return;
 
-	if ( nows > arstart ) {
-		if ( arcode == -1 )
-			return;
-			
-		fd = map_funcdiv(arcode);
-		arn = nows - arstart;
-		arr = (arn / (unsigned long) arbuf[divstate[fd].arbuf].interval);
-		if ( nextar != arr ) {
-		//	Serial.print("Repeat for ");
-		//	Serial.println(arcode);
-			nextar = arr;
-			if ( ks || ! arr ) 
-				uart_putc_raw(uart0, arcode );
-			else
-				uart_putc_raw(uart0, KBD_METRONOME );
-		} 
-	}
+    latency = time_us_32() - kbd_rx_stamp;
+    if(latency > kbd_rx_latency_max)
+        kbd_rx_latency_max = latency;
 
-}
+    while(kbd_rx_rdptr != kbd_rx_wrptr) {
+        cmd_param[cmd_pos] = kbd_rxbuf[kbd_rx_rdptr & (KBD_RX_QUEUE - 1)];
+        kbd_rx_rdptr++;
 
-void keyboard_dowork() {
-    if(uart_is_readable(uart0)) {
-        cmd_param[cmd_pos] = uart_getc(uart0);
         if(cmd_param[cmd_pos] & 0x80) {
             keyboard_parsecmd();
             cmd_pos = 0;
@@ -444,30 +620,253 @@ void keyboard_dowork() {
                 cmd_pos++;
         }
     }
-    
+}
+
+// Publish a change of the USB side state to core1
+static void keyboard_post(uint8_t code, bool down) {
+    uint32_t word = keystate[KBD_WORD(code)];
+    uint8_t next;
+
+    // Odd sequence numbers mark an update in progress for keyboard_snapshot()
+    keystate_seq++;
+    __dmb();
+    keystate[KBD_WORD(code)] = down ? (word | KBD_BIT(code)) : (word & ~KBD_BIT(code));
+    __dmb();
+    keystate_seq++;
+
+    next = kbd_ev_wrptr + 1;
+    if((next & (KBD_EVENT_QUEUE - 1)) == (kbd_ev_rdptr & (KBD_EVENT_QUEUE - 1))) {
+        // Queue full, have core1 resynchronize from keystate[]
+        kbd_ev_overflow = true;
+        return;
+    }
+
+    kbd_events[kbd_ev_wrptr & (KBD_EVENT_QUEUE - 1)] = code | (down ? KBD_EVENT_DOWN : 0);
+    __dmb();
+    kbd_ev_wrptr = next;
+}
+
+// Move the shift the host sees to force, or back to the USB shift keys
+// when force is -1. Nothing is sent when it is already there, so only
+// keystrokes that really need the other shift state cost extra codes.
+static void keyboard_shift(int force) {
+    bool held = keyrefs[KBD_SHIFT] != 0;
+    bool now = (shift_force >= 0) ? shift_force : held;
+    bool next = (force >= 0) ? force : held;
+
+    shift_force = force;
+    if(now != next)
+        keyboard_post(KBD_SHIFT, next);
+}
+
+// Called from the USB side (core0) for every press and release of a USB
+// key mapping to code. Several keys, on one keyboard or several, can hold
+// the same LK201 key down; it only goes up once all of them are released.
+void keyboard_key(uint8_t code, bool down) {
+    if(down) {
+        if(keyrefs[code]++ != 0)
+            return;
+    } else {
+        if((keyrefs[code] == 0) || (--keyrefs[code] != 0))
+            return;
+    }
+
+    // The shift keys only count once the override ends
+    if((code == KBD_SHIFT) && (shift_force >= 0))
+        return;
+
+    keyboard_post(code, down);
+
+    if(!down && (code == shift_forcer)) {
+        shift_forcer = -1;
+        keyboard_shift(-1);
+    }
+}
+
+// Press code with the host seeing shift down or up, whatever the USB shift
+// keys say, for layouts whose symbols sit on other LK201 keys. The shift
+// is held for as long as code is, so its auto-repeat keeps typing the same
+// symbol; keys pressed meanwhile see the forced shift too.
+void keyboard_key_shifted(uint8_t code, bool shift) {
+    // Already held by another key, it keeps the shift it went down with
+    if((keyrefs[code] != 0) || (code == KBD_SHIFT)) {
+        keyboard_key(code, true);
+        return;
+    }
+
+    // Shift has to reach the host ahead of the key
+    keyboard_shift(shift);
+    shift_forcer = code;
+
+    keyrefs[code]++;
+    keyboard_post(code, true);
+}
+
+// Take a consistent copy of the USB side key state
+static void keyboard_snapshot(uint32_t *snap) {
+    uint32_t seq;
+    int i;
+
+    do {
+        seq = keystate_seq;
+        __dmb();
+        for(i = 0; i < KBD_WORDS; i++)
+            snap[i] = keystate[i];
+        __dmb();
+    } while((seq & 1) || (seq != keystate_seq));
+}
+
+static bool keyboard_dnup_held() {
+    int i;
+
+    for(i = 0; i < KBD_WORDS; i++)
+        if(keys[i] & dnupkeys[i])
+            return true;
+
+    return false;
+}
+
+static void keyboard_press(uint8_t code) {
+    int fd = funcdiv[code];
+
+    if(keys[KBD_WORD(code)] & KBD_BIT(code))
+        return;
+
+    keys[KBD_WORD(code)] |= KBD_BIT(code);
+
+    keyboard_sound(2);
+
+    // A new keystroke ends a temporary auto-repeat inhibit
+    if(autoinhibit == 1)
+        autoinhibit = 0;
+
+    // Stop the old repeat first, a tick in between would send a metronome
+    // for the new key
+    if ( divstate[fd].mode == FDM_AUTO )
+        keyboard_ar_stop();
+
+    keyboard_sendkey(code);
+
+    if ( divstate[fd].mode == FDM_AUTO )
+        keyboard_ar_start(code);
+}
+
+static void keyboard_release(uint8_t code) {
+    int fd = funcdiv[code];
+
+    if(!(keys[KBD_WORD(code)] & KBD_BIT(code)))
+        return;
+
+    keys[KBD_WORD(code)] &= ~KBD_BIT(code);
+
+    if ( arcode == code ) {
+        // Fall back to the highest auto-repeating key still held
+        keyboard_ar_stop();
+        keyboard_ar_held();
+    }
+
+    if ( divstate[fd].mode == FDM_DNUP ) {
+        /* Last down/up key released sends all ups, others their own code */
+        if(keyboard_dnup_held())
+            keyboard_sendkey(code);
+        else
+            keyboard_sendkey(KBD_ALL_UPS );
+    }
+}
+
+// Diff the USB side state against what the host has seen, 32 keys at a time
+static void keyboard_resync() {
+    uint32_t snap[KBD_WORDS];
+    uint32_t diff;
+    int i, bit;
+
+    keyboard_snapshot(snap);
+
+    for(i = 0; i < KBD_WORDS; i++) {
+        diff = snap[i] ^ keys[i];
+        while(diff) {
+            bit = __builtin_ctz(diff);
+            diff &= diff - 1;
+
+            if(snap[i] & (1u << bit))
+                keyboard_press((i << 5) | bit);
+            else
+                keyboard_release((i << 5) | bit);
+        }
+    }
+}
+
+#ifdef KEYBOARD_BENCHMARK
+// SysTick cycle counts for keyboard_scan(), read them out with a debugger.
+// SysTick is per core, core1_loop() starts the one keyboard_scan() runs on.
+uint32_t kbd_bench_last;
+uint32_t kbd_bench_max;
+uint32_t kbd_bench_scans;
+uint64_t kbd_bench_total;
+#endif
+
+static void keyboard_scan() {
+	uint16_t ev;
+#ifdef KEYBOARD_BENCHMARK
+	uint32_t bench_start = systick_hw->cvr;
+#endif
+
+	/* Consume key events from the USB side */
+	while ( kbd_ev_rdptr != kbd_ev_wrptr ) {
+		ev = kbd_events[kbd_ev_rdptr & (KBD_EVENT_QUEUE - 1)];
+		__dmb();
+		kbd_ev_rdptr++;
+
+		if ( ev & KBD_EVENT_DOWN )
+			keyboard_press(ev & 0xFF);
+		else
+			keyboard_release(ev & 0xFF);
+	}
+
+	/* Events were dropped, diff against a snapshot instead */
+	if ( kbd_ev_overflow ) {
+		kbd_ev_overflow = false;
+		__dmb();
+		keyboard_resync();
+	}
+
+#ifdef KEYBOARD_BENCHMARK
+	kbd_bench_last = (bench_start - systick_hw->cvr) & 0xFFFFFF;
+	if ( kbd_bench_last > kbd_bench_max )
+		kbd_bench_max = kbd_bench_last;
+	kbd_bench_total += kbd_bench_last;
+	kbd_bench_scans++;
+#endif
+}
+
+void keyboard_dowork() {
+    keyboard_rxdrain();
     keyboard_scan();
 }
 
 void keyboard_init() {
-    pwm_config pwmcfg;
+    // Auto-repeat runs from its own hardware alarm, serviced on this core
+    ar_alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(ar_alarm, keyboard_ar_callback);
 
     uart_init(uart0, 4800);
     uart_set_format(uart0, 8, 1, UART_PARITY_NONE);
     gpio_set_function(0, GPIO_FUNC_UART);
     gpio_set_function(1, GPIO_FUNC_UART);
+
+    // FIFOs stay on. RX interrupts at 1/8 full, or once the line has been
+    // idle for 32 bit times with anything in the FIFO, so a lone command
+    // byte is not left waiting. Serviced on the calling core.
+    uart_set_fifo_enabled(uart0, true);
+    hw_write_masked(&uart_get_hw(uart0)->ifls,
+                    (0 << UART_UARTIFLS_RXIFLSEL_LSB) | (0 << UART_UARTIFLS_TXIFLSEL_LSB),
+                    UART_UARTIFLS_RXIFLSEL_BITS | UART_UARTIFLS_TXIFLSEL_BITS);
+    irq_set_exclusive_handler(UART0_IRQ, keyboard_uart_irq);
+    irq_set_enabled(UART0_IRQ, true);
+    uart_get_hw(uart0)->imsc = UART_UARTIMSC_RXIM_BITS | UART_UARTIMSC_RTIM_BITS;
     
     // Bell / Keyclick output
-    gpio_set_function(10, GPIO_FUNC_PWM);
-    audio_slice = pwm_gpio_to_slice_num(10);
-    audio_chan = pwm_gpio_to_channel(10);
-    pwmcfg = pwm_get_default_config();
-    pwm_config_set_clkdiv(&pwmcfg, 125);
-    pwm_init(audio_slice, &pwmcfg, false);
-    pwm_set_wrap(audio_slice, 500);
-    pwm_set_chan_level(audio_slice, audio_chan, 0);
-    pwm_set_enabled(audio_slice, true);
-
-    arstart = board_millis() + 99999999;
+    audio_init(10);
 
     sleep_ms(50);
     keyboard_selftest();
@@ -1,11 +1,12 @@
 #ifndef __KEYBOARD_H
 #define __KEYBOARD_H
 
-extern bool keystate[256];
 extern bool ledstate[4];
 
 extern void keyboard_init();
 extern void keyboard_dowork();
 extern void keyboard_sound(uint ms);
+extern void keyboard_key(uint8_t code, bool down);
+extern void keyboard_key_shifted(uint8_t code, bool shift);
 
 #endif /* __KEYBOARD_H */
\ No newline at end of file
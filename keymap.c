@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <pico/stdlib.h>
+#include <hardware/gpio.h>
+
+#include "keymap.h"
+
+// Keymaps live in flash as flat 256 entry layers, one read per key. The
+// strap pins pick one at power up so sites with different keyboards can
+// share a firmware image.
+
+// Full range of HID keyboard usages, modifiers included so left and right
+// can be mapped apart
+static uint8_t const pc_base[256] = {
+    0x00, /* 0x00 NONE */
+    0x00, /* 0x01 ERR ROLLOVER */
+    0x00, /* 0x02 POST FAIL */
+    0x00, /* 0x03 UNDEFINED */
+    0xC2, /* 0x04 'A' */
+    0xD9, /* 0x05 'B' */
+    0xCE, /* 0x06 'C' */
+    0xCD, /* 0x07 'D' */
+    0xCC, /* 0x08 'E' */
+    0xD2, /* 0x09 'F' */
+    0xD8, /* 0x0a 'G' */
+    0xDD, /* 0x0b 'H' */
+    0xE6, /* 0x0c 'I' */
+    0xE2, /* 0x0d 'J' */
+    0xE7, /* 0x0e 'K' */
+    0xEC, /* 0x0f 'L' */
+    0xE3, /* 0x10 'M' */
+    0xDE, /* 0x11 'N' */
+    0xEB, /* 0x12 'O' */
+    0xF0, /* 0x13 'P' */
+    0xC1, /* 0x14 'Q' */
+    0xD1, /* 0x15 'R' */
+    0xC7, /* 0x16 'S' */
+    0xD7, /* 0x17 'T' */
+    0xE1, /* 0x18 'U' */
+    0xD3, /* 0x19 'V' */
+    0xC6, /* 0x1a 'W' */
+    0xC8, /* 0x1b 'X' */
+    0xDC, /* 0x1c 'Y' */
+    0xC3, /* 0x1d 'Z' */
+    0xC0, /* 0x1e '!' */
+    0xC5, /* 0x1f '@' */
+    0xCB, /* 0x20 '#' */
+    0xD0, /* 0x21 '$' */
+    0xD6, /* 0x22 '%' */
+    0xDB, /* 0x23 '^' */
+    0xE0, /* 0x24 '&' */
+    0xE5, /* 0x25 '*' */
+    0xEA, /* 0x26 '(' */
+    0xEF, /* 0x27 ')' */
+    0xBD, /* 0x28 CR  */
+    0x71, /* 0x29 ESC */
+    0xBC, /* 0x2a BS  */
+    0xBE, /* 0x2b Tab */
+    0xD4, /* 0x2c ' ' */
+    0xF9, /* 0x2d '_' */
+    0xF5, /* 0x2e '+' */
+    0xFA, /* 0x2f '{' */
+    0xF6, /* 0x30 '}' */
+    0xF7, /* 0x31 '|' */
+    0xBF, /* 0x32 '#' */
+    0xF2, /* 0x33 ';' */
+    0xFB, /* 0x34 ''' */
+    0xBF, /* 0x35 '`' */
+    0xE8, /* 0x36 ',' */
+    0xED, /* 0x37 '.' */
+    0xF3, /* 0x38 '/' */
+    0x00, /* 0x39 CAPS */
+    0x56, /* 0x3a F1 */
+    0x57, /* 0x3b F2 */
+    0x58, /* 0x3c F3 */
+    0x59, /* 0x3d F4 */
+    0x5A, /* 0x3e F5 */
+    0x64, /* 0x3f F6 */
+    0x65, /* 0x40 F7 */
+    0x66, /* 0x41 F8 */
+    0x67, /* 0x42 F9 */
+    0x68, /* 0x43 F10 */
+    0x71, /* 0x44 F11 */
+    0x72, /* 0x45 F12 */
+    0x7C, /* 0x46 SysRq */
+    0x7D, /* 0x47 Scroll */
+    0xB0, /* 0x48 Pause */
+    0x8B, /* 0x49 INS */
+    0x8A, /* 0x4a HOME */
+    0x8E, /* 0x4b PGUP */
+    0x8C, /* 0x4c DEL */
+    0x8D, /* 0x4d END */
+    0x8F, /* 0x4e PGDN */
+    0xA8, /* 0x4f RIGHT */
+    0xA7, /* 0x50 LEFT */
+    0xA9, /* 0x51 DOWN */
+    0xAA, /* 0x52 UP */
+    0xA1, /* 0x53 NUMLOCK */
+    0xA2, /* 0x54 '/' */
+    0xA3, /* 0x55 '*' */
+    0xA4, /* 0x56 '-' */
+    0x9C, /* 0x57 '+' */
+    0x95, /* 0x58 ENT */
+    0x96, /* 0x59 '1' */
+    0x97, /* 0x5a '2' */
+    0x98, /* 0x5b '3' */
+    0x99, /* 0x5c '4' */
+    0x9A, /* 0x5d '5' */
+    0x9B, /* 0x5e '6' */
+    0x9D, /* 0x5f '7' */
+    0x9E, /* 0x60 '8' */
+    0x9F, /* 0x61 '9' */
+    0x92, /* 0x62 '0' */
+    0x94, /* 0x63 '.' */
+    0xF7, /* 0x64 '|' */
+    0xB1, /* 0x65 COMPOSE */
+    0x00, /* 0x66 POWER */
+    0xF5, /* 0x67 '=' */
+    0x73, /* 0x68 F13 */
+    0x74, /* 0x69 F14 */
+    0x7C, /* 0x6A F15 */
+    0x7D, /* 0x6B F16 */
+    0x80, /* 0x6C F17 */
+    0x81, /* 0x6D F18 */
+    0x82, /* 0x6E F19 */
+    0x83, /* 0x6F F20 */
+    0xA1, /* 0x70 F21 */
+    0xA2, /* 0x71 F22 */
+    0xA3, /* 0x72 F23 */
+    0xA4, /* 0x73 F24 */
+    0x7D, /* 0x74 Open */
+    0x7C, /* 0x75 Help */
+    0x74, /* 0x76 Menu */
+    0x8D, /* 0x77 Select */
+    0x00, /* 0x78 Stop */
+    0x00, /* 0x79 Again */
+    0x00, /* 0x7a Undo */
+    0x00, /* 0x7b Cut */
+    0x00, /* 0x7c Copy */
+    0x00, /* 0x7d Paste */
+    0x8A, /* 0x7e Find */
+    0x00, /* 0x7f Mute */
+    0x00, /* 0x80 Volume Up */
+    0x00, /* 0x81 Volume Down */
+    0x00, /* 0x82 Locking Caps */
+    0x00, /* 0x83 Locking Num */
+    0x00, /* 0x84 Locking Scroll */
+    0x9C, /* 0x85 KP ',' */
+    0x00, /* 0x86 KP '=' */
+    0xC9, /* 0x87 Intl1 Ro */
+    0x00, /* 0x88 Intl2 Kana */
+    0xF7, /* 0x89 Intl3 Yen */
+    0x00, /* 0x8a Intl4 Henkan */
+    0x00, /* 0x8b Intl5 Muhenkan */
+    0x00, /* 0x8c Intl6 */
+    0x00, /* 0x8d Intl7 */
+    0x00, /* 0x8e Intl8 */
+    0x00, /* 0x8f Intl9 */
+    0x00, /* 0x90 Lang1 Hangul */
+    0x00, /* 0x91 Lang2 Hanja */
+    0x00, /* 0x92 Lang3 */
+    0x00, /* 0x93 Lang4 */
+    0x00, /* 0x94 Lang5 */
+    0x00, /* 0x95 Lang6 */
+    0x00, /* 0x96 Lang7 */
+    0x00, /* 0x97 Lang8 */
+    0x00, /* 0x98 Lang9 */
+    0xBC, /* 0x99 Alt Erase */
+    0x7C, /* 0x9a SysReq */
+    0x00, /* 0x9b Cancel */
+    0x8C, /* 0x9c Clear */
+    0x00, /* 0x9d Prior */
+    0xBD, /* 0x9e Return */
+    0x9C, /* 0x9f Separator */
+    0x00, /* 0xa0 Out */
+    0x00, /* 0xa1 Oper */
+    0x00, /* 0xa2 Clear/Again */
+    0x00, /* 0xa3 CrSel */
+    0x00, /* 0xa4 ExSel */
+    0x00, /* 0xa5 Reserved */
+    0x00, /* 0xa6 Reserved */
+    0x00, /* 0xa7 Reserved */
+    0x00, /* 0xa8 Reserved */
+    0x00, /* 0xa9 Reserved */
+    0x00, /* 0xaa Reserved */
+    0x00, /* 0xab Reserved */
+    0x00, /* 0xac Reserved */
+    0x00, /* 0xad Reserved */
+    0x00, /* 0xae Reserved */
+    0x00, /* 0xaf Reserved */
+    0x00, /* 0xb0 KP '00' */
+    0x00, /* 0xb1 KP '000' */
+    0x00, /* 0xb2 Thousands Sep */
+    0x00, /* 0xb3 Decimal Sep */
+    0x00, /* 0xb4 Currency */
+    0x00, /* 0xb5 Currency Sub */
+    0x00, /* 0xb6 KP '(' */
+    0x00, /* 0xb7 KP ')' */
+    0x00, /* 0xb8 KP '{' */
+    0x00, /* 0xb9 KP '}' */
+    0xBE, /* 0xba KP Tab */
+    0xBC, /* 0xbb KP BS */
+    0x00, /* 0xbc KP 'A' */
+    0x00, /* 0xbd KP 'B' */
+    0x00, /* 0xbe KP 'C' */
+    0x00, /* 0xbf KP 'D' */
+    0x00, /* 0xc0 KP 'E' */
+    0x00, /* 0xc1 KP 'F' */
+    0x00, /* 0xc2 KP XOR */
+    0x00, /* 0xc3 KP '^' */
+    0x00, /* 0xc4 KP '%' */
+    0x00, /* 0xc5 KP '<' */
+    0x00, /* 0xc6 KP '>' */
+    0x00, /* 0xc7 KP '&' */
+    0x00, /* 0xc8 KP '&&' */
+    0x00, /* 0xc9 KP '|' */
+    0x00, /* 0xca KP '||' */
+    0x00, /* 0xcb KP ':' */
+    0x00, /* 0xcc KP '#' */
+    0x00, /* 0xcd KP Space */
+    0x00, /* 0xce KP '@' */
+    0x00, /* 0xcf KP '!' */
+    0x00, /* 0xd0 KP MS */
+    0x00, /* 0xd1 KP MR */
+    0x00, /* 0xd2 KP MC */
+    0x00, /* 0xd3 KP M+ */
+    0x00, /* 0xd4 KP M- */
+    0x00, /* 0xd5 KP M* */
+    0x00, /* 0xd6 KP M/ */
+    0x00, /* 0xd7 KP +/- */
+    0x00, /* 0xd8 KP Clear */
+    0x00, /* 0xd9 KP Clear Entry */
+    0x00, /* 0xda KP Binary */
+    0x00, /* 0xdb KP Octal */
+    0x00, /* 0xdc KP Decimal */
+    0x00, /* 0xdd KP Hex */
+    0x00, /* 0xde Reserved */
+    0x00, /* 0xdf Reserved */
+    0xAF, /* 0xe0 LEFT CTRL */
+    0xAE, /* 0xe1 LEFT SHIFT */
+    0xB1, /* 0xe2 LEFT ALT */
+    0x00, /* 0xe3 LEFT GUI */
+    0xAF, /* 0xe4 RIGHT CTRL */
+    0xAE, /* 0xe5 RIGHT SHIFT */
+    0xB1, /* 0xe6 RIGHT ALT */
+    0x00, /* 0xe7 RIGHT GUI, Fn */
+    0x00, /* 0xe8 Reserved */
+    0x00, /* 0xe9 Reserved */
+    0x00, /* 0xea Reserved */
+    0x00, /* 0xeb Reserved */
+    0x00, /* 0xec Reserved */
+    0x00, /* 0xed Reserved */
+    0x00, /* 0xee Reserved */
+    0x00, /* 0xef Reserved */
+    0x00, /* 0xf0 Reserved */
+    0x00, /* 0xf1 Reserved */
+    0x00, /* 0xf2 Reserved */
+    0x00, /* 0xf3 Reserved */
+    0x00, /* 0xf4 Reserved */
+    0x00, /* 0xf5 Reserved */
+    0x00, /* 0xf6 Reserved */
+    0x00, /* 0xf7 Reserved */
+    0x00, /* 0xf8 Reserved */
+    0x00, /* 0xf9 Reserved */
+    0x00, /* 0xfa Reserved */
+    0x00, /* 0xfb Reserved */
+    0x00, /* 0xfc Reserved */
+    0x00, /* 0xfd Reserved */
+    0x00, /* 0xfe Reserved */
+    0x00, /* 0xff Reserved */
+};
+
+// LK201 keys a PC keyboard lacks, F13, F14, F17-F20 and the keypad minus
+#define FN_COMMON \
+    [0x39] = 0xB0, /* CAPS -> Lock */ \
+    [0x3a] = 0x73, /* F1 -> F13 */ \
+    [0x3b] = 0x74, /* F2 -> F14 */ \
+    [0x3c] = 0x80, /* F3 -> F17 */ \
+    [0x3d] = 0x81, /* F4 -> F18 */ \
+    [0x3e] = 0x82, /* F5 -> F19 */ \
+    [0x3f] = 0x83, /* F6 -> F20 */ \
+    [0x56] = 0xA0, /* KP '-' -> KP '-' */
+
+static uint8_t const pc_fn[256] = {
+    FN_COMMON
+};
+
+// Tenkeyless and laptop keyboards, the editing keypad, PF keys and a
+// numeric keypad overlaid on the letters
+static uint8_t const compact_fn[256] = {
+    FN_COMMON
+    [0x1e] = 0xA1, /* '1' -> PF1 */
+    [0x1f] = 0xA2, /* '2' -> PF2 */
+    [0x20] = 0xA3, /* '3' -> PF3 */
+    [0x21] = 0xA4, /* '4' -> PF4 */
+    [0x0b] = 0x7C, /* 'H' -> Help */
+    [0x07] = 0x7D, /* 'D' -> Do */
+    [0x09] = 0x8A, /* 'F' -> Find */
+    [0x16] = 0x8D, /* 'S' -> Select */
+    [0x24] = 0x9D, /* '7' -> KP '7' */
+    [0x25] = 0x9E, /* '8' -> KP '8' */
+    [0x26] = 0x9F, /* '9' -> KP '9' */
+    [0x27] = 0xA0, /* '0' -> KP '-' */
+    [0x18] = 0x99, /* 'U' -> KP '4' */
+    [0x0c] = 0x9A, /* 'I' -> KP '5' */
+    [0x12] = 0x9B, /* 'O' -> KP '6' */
+    [0x0d] = 0x96, /* 'J' -> KP '1' */
+    [0x0e] = 0x97, /* 'K' -> KP '2' */
+    [0x0f] = 0x98, /* 'L' -> KP '3' */
+    [0x33] = 0x9C, /* ';' -> KP ',' */
+    [0x10] = 0x92, /* 'M' -> KP '0' */
+    [0x37] = 0x94, /* '.' -> KP '.' */
+    [0x38] = 0x95, /* '/' -> KP ENT */
+};
+
+// The LK201 comma and period keys type the same symbol shifted, '<' and
+// '>' have their own key next to Z
+#define SHIFT   (256)
+#define XLAT_US \
+    [SHIFT + 0x36] = 0xC9 | KEYMAP_SHIFT_UP,    /* '<' */ \
+    [SHIFT + 0x37] = 0xC9,                      /* '>' */
+
+static uint16_t const us_xlat[512] = {
+    XLAT_US
+};
+
+// UK keyboards swap '"' and '@' and have '#' and '~' on their own key
+static uint16_t const uk_xlat[512] = {
+    XLAT_US
+    [SHIFT + 0x1f] = 0xFB,                      /* '"' */
+    [SHIFT + 0x34] = 0xC5,                      /* '@' */
+    [0x32]         = 0xCB | KEYMAP_SHIFT_DOWN,  /* '#' */
+    [SHIFT + 0x32] = 0xBF,                      /* '~' */
+};
+
+// Media and application keys standing in for LK201 keys a small keyboard
+// lacks, ended by a page of 0
+static keymap_control_t const pc_controls[] = {
+    { 0x0C, 0x0095, 0x7C }, /* Help -> Help */
+    { 0x0C, 0x0192, 0x7D }, /* AL Calculator -> Do */
+    { 0x0C, 0x0221, 0x8A }, /* AC Search -> Find */
+    { 0x0C, 0x00CD, 0x80 }, /* Play/Pause -> F17 */
+    { 0x0C, 0x00B7, 0x81 }, /* Stop -> F18 */
+    { 0x0C, 0x00B6, 0x82 }, /* Scan Previous -> F19 */
+    { 0x0C, 0x00B5, 0x83 }, /* Scan Next -> F20 */
+    { 0x01, 0x0084, 0x7D }, /* System Context Menu -> Do */
+    { 0 }
+};
+
+// Indexed by the strap pins, Right GUI holds the Fn layer
+static keymap_t const keymaps[] = {
+    { "pc", 0xE7, pc_base, pc_fn, us_xlat, pc_controls },
+    { "compact", 0xE7, pc_base, compact_fn, us_xlat, pc_controls },
+    { "pc-uk", 0xE7, pc_base, pc_fn, uk_xlat, pc_controls },
+    { "compact-uk", 0xE7, pc_base, compact_fn, uk_xlat, pc_controls },
+};
+
+#define KEYMAPS (sizeof(keymaps) / sizeof(keymaps[0]))
+
+static keymap_t const *keymap = &keymaps[0];
+static uint8_t strap = 0xFF;
+static uint32_t strap_ms;
+
+// LK201 code the current keymap binds a control usage to, 0 when unbound
+uint8_t keymap_control(uint16_t page, uint16_t usage) {
+    keymap_control_t const *c;
+
+    for(c = keymap->controls; c->page; c++)
+        if((c->page == page) && (c->usage == usage))
+            return c->code;
+
+    return 0;
+}
+
+bool keymap_select(uint8_t index) {
+    if(index >= KEYMAPS)
+        return false;
+
+    keymap = &keymaps[index];
+    return true;
+}
+
+keymap_t const *keymap_current() {
+    return keymap;
+}
+
+static uint8_t keymap_strap() {
+    return (!gpio_get(KEYMAP_STRAP_PIN0) ? 1 : 0) | (!gpio_get(KEYMAP_STRAP_PIN1) ? 2 : 0);
+}
+
+// Straps that pick a missing keymap leave the current one in place
+void keymap_task() {
+    uint32_t const now = to_ms_since_boot(get_absolute_time());
+
+    if(now - strap_ms < KEYMAP_STRAP_MS)
+        return;
+    strap_ms = now;
+
+    uint8_t const s = keymap_strap();
+    if(s != strap) {
+        strap = s;
+        keymap_select(s);
+    }
+}
+
+void keymap_init() {
+    gpio_init(KEYMAP_STRAP_PIN0);
+    gpio_set_dir(KEYMAP_STRAP_PIN0, GPIO_IN);
+    gpio_pull_up(KEYMAP_STRAP_PIN0);
+
+    gpio_init(KEYMAP_STRAP_PIN1);
+    gpio_set_dir(KEYMAP_STRAP_PIN1, GPIO_IN);
+    gpio_pull_up(KEYMAP_STRAP_PIN1);
+
+    // Let the pull ups charge the pins before the first read
+    sleep_us(10);
+
+    strap = keymap_strap();
+    keymap_select(strap);
+    strap_ms = to_ms_since_boot(get_absolute_time());
+}
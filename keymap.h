@@ -0,0 +1,59 @@
+#ifndef __KEYMAP_H
+#define __KEYMAP_H
+
+// Strap pins choosing the keymap at power up, pulled up so an open pin
+// reads as 0 and a pin tied to ground as 1. GPIO26 is bit 0.
+#ifndef KEYMAP_STRAP_PIN0
+#define KEYMAP_STRAP_PIN0   (26)
+#endif
+#ifndef KEYMAP_STRAP_PIN1
+#define KEYMAP_STRAP_PIN1   (27)
+#endif
+
+// Strap changes are picked up this often, so a switch works without a reset
+#define KEYMAP_STRAP_MS     (250)
+
+// Translation entries carry the shift state the host must see with the key
+#define KEYMAP_SHIFT_UP     (0x100)
+#define KEYMAP_SHIFT_DOWN   (0x200)
+
+// Consumer and system control usage bound to an LK201 key
+typedef struct keymap_control_s {
+    uint16_t page;              // HID usage page, 0 ends the list
+    uint16_t usage;
+    uint8_t code;
+} keymap_control_t;
+
+// One layer maps every HID keyboard usage 0x00-0xFF to an LK201 keycode,
+// 0 for no key. Fn layer entries of 0 fall through to the translation
+// and then the base layer.
+//
+// The translation covers symbols the keyboard's layout puts on other keys
+// than the LK201 does. It is indexed by usage, plus 256 with USB shift
+// down, 0 where the base layer already types the right symbol.
+typedef struct keymap_s {
+    const char *name;
+    uint8_t fn_key;             // usage that holds the Fn layer, 0 for none
+    uint8_t const *base;
+    uint8_t const *fn;
+    uint16_t const *xlat;       // 512 entries
+    keymap_control_t const *controls;
+} keymap_t;
+
+extern void keymap_init();
+extern void keymap_task();
+extern bool keymap_select(uint8_t index);
+extern keymap_t const *keymap_current();
+extern uint8_t keymap_control(uint16_t page, uint16_t usage);
+
+// O(1), three table reads at most. The LK201 code is in the low byte.
+static inline uint16_t keymap_lookup(keymap_t const *map, uint8_t usage, bool shift, bool fn) {
+    uint16_t code = fn ? map->fn[usage] : 0;
+
+    if(!code)
+        code = map->xlat[shift ? (usage + 256) : usage];
+
+    return code ? code : map->base[usage];
+}
+
+#endif /* __KEYMAP_H */
\ No newline at end of file
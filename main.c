@@ -3,40 +3,48 @@
 #include <pico/stdlib.h>
 #include <pico/multicore.h>
 #include <hardware/gpio.h>
+#ifdef KEYBOARD_BENCHMARK
+#include <hardware/structs/systick.h>
+#endif
 
 #include "bsp/board.h"
 #include "tusb.h"
 
+#include "stream.h"
 #include "mouse.h"
 #include "tablet.h"
 #include "keyboard.h"
+#include "ballistics.h"
+#include "keymap.h"
 
 void led_blinking_task(void);
 extern void cdc_app_task(void);
 extern void hid_app_task(void);
 
-bool tablet_enabled = false;
-
 void core1_loop() {
+#ifdef KEYBOARD_BENCHMARK
+    // Free running SysTick on the processor clock. Each core has its own,
+    // this is the one keyboard_scan() reads.
+    systick_hw->rvr = 0x00FFFFFF;
+    systick_hw->cvr = 0;
+    systick_hw->csr = 0x5;
+#endif
+
+    // UART0 interrupts are serviced on the core that initializes the keyboard
+    keyboard_init();
+
+    // uart1 starts as a mouse, hid_app switches it to a tablet when an
+    // absolute pointer is plugged in. Stream timers fire on this core too,
+    // from the alarm pool stream_init() creates here.
+    stream_init(&mouse_engine);
+
     for(;;) {
         keyboard_dowork();
-        if(tablet_enabled) {
-            tablet_dowork();
-        } else {
-            mouse_dowork();
-        }
+        stream_dowork();
     }
 }
 
 int main() {
-    keyboard_init();
-
-    if(tablet_enabled) {
-        tablet_init();
-    } else {
-        mouse_init();
-    }
-
     board_init();
 
     // Red LED
@@ -51,6 +59,12 @@ int main() {
     gpio_set_dir(17, GPIO_OUT);
     gpio_put(17, 0);
     
+    // Curve tables must be ready before the first mouse report
+    ballistics_init();
+
+    // Strap pins pick the keyboard layout
+    keymap_init();
+
     tuh_init(BOARD_TUH_RHPORT);
 
     multicore_launch_core1(core1_loop);
@@ -59,6 +73,7 @@ int main() {
         tuh_task();
         cdc_app_task();
         hid_app_task();
+        keymap_task();
         led_blinking_task();
     }
 }
@@ -1,39 +1,148 @@
 #include <stdio.h>
 #include <string.h>
 #include <pico/stdlib.h>
+#include <hardware/sync.h>
+#include <hardware/timer.h>
 
+#include "stream.h"
 #include "mouse.h"
+#include "ballistics.h"
 
 mouse_status_t mouse_status;
+static alarm_id_t mouse_alarm;          // Power up self test
 
-mouse_packet_t mp_queue[256];
-uint8_t mp_wrptr = 0;
-uint8_t mp_rdptr = 0;
+// Single producer (USB, core0), single consumer (core1, mouse_dowork() and
+// nothing else: the stream timer only flags a report as due). The slot at
+// mp_wrptr is owned by the producer until mp_wrptr moves past it.
+static mouse_packet_t mp_queue[MOUSE_QUEUE];
+static volatile uint32_t mp_wrptr;
+static volatile uint32_t mp_rdptr;
+static bool mp_pending;                 // mp_queue[mp_wrptr] holds merged motion
 
-void mouse_packet_enqueue(int8_t x, int8_t y, uint8_t buttons) {
-    if(mp_wrptr+1 != mp_rdptr) {
-        mp_queue[mp_wrptr].x = x;
-        mp_queue[mp_wrptr].y = y;
-        mp_queue[mp_wrptr].buttons = buttons;
-        mp_wrptr++;
+uint32_t mp_merges;                     // Reports folded into a pending entry
+uint32_t mp_button_merges;              // ... of which changed the buttons
+
+// USB report arrivals, written by core0, used to phase the stream timer
+#define MOUSE_USB_IDLE_US   (50000)     // Longer gaps are the mouse resting
+#define MOUSE_PHASE_US      (250)       // Report this long after a sample lands
+static volatile uint32_t mp_arrival;
+static volatile uint32_t mp_interval;   // Smoothed USB interval, 0 until known
+
+uint32_t mouse_age_hist[MOUSE_AGE_BUCKETS];
+
+static inline int16_t mouse_clamp(int32_t v) {
+    if(v > INT16_MAX)
+        return INT16_MAX;
+    if(v < INT16_MIN)
+        return INT16_MIN;
+    return v;
+}
+
+// Publish the pending entry once the consumer has made room for it
+static bool mouse_packet_publish() {
+    uint32_t next = mp_wrptr + 1;
+
+    if((next & (MOUSE_QUEUE - 1)) == (mp_rdptr & (MOUSE_QUEUE - 1)))
+        return false;
+
+    __dmb();
+    mp_wrptr = next;
+    mp_pending = false;
+    return true;
+}
+
+void mouse_packet_enqueue(int16_t x, int16_t y, uint8_t buttons) {
+    mouse_packet_t *mp;
+    uint32_t now = time_us_32();
+    uint32_t gap = now - mp_arrival;
+
+    if(gap < MOUSE_USB_IDLE_US)
+        mp_interval = mp_interval ? (mp_interval * 7 + gap) / 8 : gap;
+    else
+        gap = MOUSE_USB_IDLE_US;
+    mp_arrival = now;
+
+    ballistics_apply(&x, &y, gap);
+
+    if(mp_pending && !mouse_packet_publish()) {
+        // Still full, fold this report into the pending entry so no
+        // motion is lost; only intermediate button states can be.
+        mp = &mp_queue[mp_wrptr & (MOUSE_QUEUE - 1)];
+        mp->x = mouse_clamp(mp->x + x);
+        mp->y = mouse_clamp(mp->y + y);
+        if(mp->buttons != buttons)
+            mp_button_merges++;
+        mp->buttons = buttons;
+        mp->time = now;
+        mp_merges++;
+        return;
     }
+
+    mp = &mp_queue[mp_wrptr & (MOUSE_QUEUE - 1)];
+    mp->x = x;
+    mp->y = y;
+    mp->buttons = buttons;
+    mp->time = now;
+    mp_pending = true;
+    mouse_packet_publish();
 }
 
-static inline void mouse_packet_dequeue() {
-    if(mp_rdptr != mp_wrptr) {
-        mouse_status.dx += mp_queue[mp_rdptr].x;
-        mouse_status.dy += mp_queue[mp_rdptr].y;
-        mouse_status.buttons = mp_queue[mp_rdptr].buttons;
+// Called from the USB task loop so a merged entry goes out even when
+// the mouse has stopped sending reports.
+void mouse_packet_flush() {
+    if(mp_pending)
+        mouse_packet_publish();
+}
+
+// Integrate every pending USB sample, so the cursor never lags the
+// hand by more than one report period. Only called from core1 thread
+// context, never from the stream timer.
+static void mouse_packet_drain() {
+    mouse_packet_t *mp;
+    int32_t dx, dy;
+    uint8_t buttons;
 
+    dx = mouse_status.dx;
+    dy = mouse_status.dy;
+    buttons = mouse_status.buttons;
+    while(mp_rdptr != mp_wrptr) {
+        __dmb();
+        mp = &mp_queue[mp_rdptr & (MOUSE_QUEUE - 1)];
+        dx += mp->x;
+        dy += mp->y;
+        mouse_status.buttons_pressed |= mp->buttons & ~buttons;
+        mouse_status.buttons_released |= buttons & ~mp->buttons;
+        buttons = mp->buttons;
+        mouse_status.sample_time = mp->time;
+        mouse_status.sample_fresh = true;
+        __dmb();
         mp_rdptr++;
     }
+    mouse_status.dx = mouse_clamp(dx);
+    mouse_status.dy = mouse_clamp(dy);
+    mouse_status.buttons = buttons;
+}
+
+// Button state for the next packet. A press or release since the last
+// packet is shown for at least one packet, even if the button has
+// already gone back; the later edge stays latched for the packet after.
+static uint8_t mouse_buttons() {
+    uint8_t reported = mouse_status.laststate & 0x7;
+    uint8_t dn = ~reported & mouse_status.buttons_pressed;
+    uint8_t up = reported & mouse_status.buttons_released;
+    uint8_t out = (mouse_status.buttons & ~(dn | up)) | dn;
+
+    mouse_status.buttons_pressed &= ~out;
+    mouse_status.buttons_released &= out;
+
+    return out & 0x7;
 }
 
 static void mouse_report() {
     uint8_t mouse_x, mouse_y;
     uint8_t mouse_s = 0x00;
 
-    mouse_packet_dequeue();
+    mouse_packet_drain();
 
     // Translate X movement
     if(mouse_status.dx == 0) {
@@ -77,7 +186,7 @@ static void mouse_report() {
         mouse_status.dy = 0;
     }
 
-    mouse_s |= (mouse_status.buttons & 0x7);
+    mouse_s |= mouse_buttons();
 
     // In polled mode, always report.
     // In stream mode, only report if we have significant changes.
@@ -94,46 +203,98 @@ static void mouse_report() {
 
     // DEC Serial Mouse Packet
     if(mouse_s & 0x80) {
-        uart_putc_raw(uart1, mouse_s);
-        uart_putc_raw(uart1, mouse_x & 0x7f);
-        uart_putc_raw(uart1, mouse_y & 0x7f);
+        uint8_t packet[3] = { mouse_s, mouse_x & 0x7f, mouse_y & 0x7f };
+        stream_send(packet, sizeof(packet));
+
+        if(mouse_status.sample_fresh) {
+            uint32_t age = (time_us_32() - mouse_status.sample_time) / 1000;
+            mouse_age_hist[age < MOUSE_AGE_BUCKETS ? age : MOUSE_AGE_BUCKETS - 1]++;
+            mouse_status.sample_fresh = false;
+        }
+    }
+}
+
+// Delay to the next stream report. Reports keep the host selected rate on
+// average, but each one is moved by up to half a USB interval so it goes
+// out just after a USB sample is expected to land.
+static int64_t mouse_stream_delay() {
+    uint64_t now = time_us_64();
+    uint64_t target;
+    uint32_t interval = mp_interval;
+    uint32_t since = time_us_32() - mp_arrival;
+    int32_t phase;
+
+    mouse_status.next_report += mouse_status.period_us;
+    if(mouse_status.next_report <= now)
+        mouse_status.next_report = now + mouse_status.period_us;
+    target = mouse_status.next_report;
+
+    if(interval && (since < MOUSE_USB_IDLE_US) && (interval <= mouse_status.period_us)) {
+        // Offset of the nominal time past the last expected arrival
+        phase = (int32_t)(target - (now - since)) - MOUSE_PHASE_US;
+        phase = ((phase % (int32_t)interval) + (int32_t)interval) % (int32_t)interval;
+
+        if(phase < (int32_t)interval / 2)
+            target -= phase;
+        else
+            target += interval - phase;
     }
+
+    if(target <= now + MOUSE_PHASE_US)
+        target = now + MOUSE_PHASE_US;
+
+    return target - now;
 }
 
+// Only marks a report as due, mouse_dowork() builds and sends it so a
+// packet is never interleaved with another on the wire.
 static bool mouse_stream_callback(struct repeating_timer *t) {
     if(mouse_status.selftest_done && (mouse_status.mode == 'R'))
-        mouse_report();
+        mouse_status.report_due = true;
 
+    // Positive, so measured from now rather than the last scheduled time
+    t->delay_us = mouse_stream_delay();
     return true;
 }
 
+static void mouse_stream_start(uint32_t period_us) {
+    mouse_status.period_us = period_us;
+    mouse_status.next_report = time_us_64() + period_us;
+    alarm_pool_add_repeating_timer_us(stream_alarm_pool, period_us, mouse_stream_callback, NULL, &mouse_status.timer);
+}
+
 static void mouse_set_reportrate(uint rate) {
     cancel_repeating_timer(&mouse_status.timer);
 
     if((mouse_status.baud == 9600) && (rate >= 120)) {
-        add_repeating_timer_ms(-9, mouse_stream_callback, NULL, &mouse_status.timer);
+        mouse_stream_start(9000);
     } else if(rate >= 72) {
-        add_repeating_timer_ms(-14, mouse_stream_callback, NULL, &mouse_status.timer);
+        mouse_stream_start(14000);
     } else {
-        add_repeating_timer_ms(-18, mouse_stream_callback, NULL, &mouse_status.timer);
+        mouse_stream_start(18000);
     }
 }
 
 static void mouse_selftest() {
-    uart_tx_wait_blocking(uart1);
-    uart_set_baudrate(uart1, 4800);
-
-    uart_putc_raw(uart1, 0xA0);  // Self Test Report, REV0
-    uart_putc_raw(uart1, 0x02);  // Manufacturing ID 0, Mouse
-    uart_putc_raw(uart1, 0x00);  // No Errors
-    uart_putc_raw(uart1, 0x00);  // No Buttons Held
+    uint8_t report[4] = {
+        0xA0,   // Self Test Report, REV0
+        0x02,   // Manufacturing ID 0, Mouse
+        0x00,   // No Errors
+        0x00,   // No Buttons Held
+    };
 
+    // Goes out at 4800 baud once anything still queued has been sent
     mouse_status.baud = 4800;
+    stream_set_baud(4800);
+    stream_send(report, sizeof(report));
     mouse_status.mode = 'D';
     mouse_status.dx = 0;
     mouse_status.dy = 0;
     mouse_status.laststate = 0;
     mouse_status.buttons = 0;
+    mouse_status.buttons_pressed = 0;
+    mouse_status.buttons_released = 0;
+    ballistics_reset();
 
     // Drain FIFO
     while(uart_is_readable(uart1)) {
@@ -143,12 +304,14 @@ static void mouse_selftest() {
     mouse_status.selftest_done = true;
 }
 
+// Power up self test, run from mouse_dowork() like one the host asks for
 static int64_t mouse_selftest_callback(alarm_id_t id, void *user_data) {
-    mouse_selftest();
+    mouse_alarm = 0;
+    mouse_status.mode = 'T';
     return 0;
 }
 
-void mouse_dowork() {
+static void mouse_dowork() {
     if(uart_get_hw(uart1)->rsr & UART_UARTRSR_BE_BITS) {
         // Serial BREAK condition
         hw_clear_bits(&uart_get_hw(uart1)->rsr, UART_UARTRSR_BITS);
@@ -161,8 +324,7 @@ void mouse_dowork() {
             case 'B':
                 // Change baud rate to 9600
                 mouse_status.baud = 9600;
-                uart_tx_wait_blocking(uart1);
-                uart_set_baudrate(uart1, 9600);
+                stream_set_baud(9600);
                 break;
             case 'S':
                 // Stream Report Format
@@ -202,15 +364,24 @@ void mouse_dowork() {
         }
     }
     
-    if(!mouse_status.selftest_done) {
+    if(!mouse_status.selftest_done && (mouse_status.mode != 'T')) {
         return;
     }
 
+    // Reports wait for the line, then carry whatever has accumulated
     switch(mouse_status.mode) {
     case 'P':
-        mouse_status.mode = 'D';
+        if(stream_ready()) {
+            mouse_status.mode = 'D';
+            mouse_report();
+        }
+        break;
     case 'R':
-        mouse_report();
+        // Due from the stream timer, at the host selected rate
+        if(mouse_status.report_due && stream_ready()) {
+            mouse_status.report_due = false;
+            mouse_report();
+        }
         break;
     case 'T':
         mouse_selftest();
@@ -218,17 +389,34 @@ void mouse_dowork() {
     }
 }
 
-void mouse_init() {
-    uart_init(uart1, 4800);
-    uart_set_format(uart1, 8, 1, UART_PARITY_ODD);
-    gpio_set_function(8, GPIO_FUNC_UART);
-    gpio_set_function(9, GPIO_FUNC_UART);
-    
+static void mouse_start(bool announce) {
     memset(&mouse_status, 0, sizeof(mouse_status));
     mouse_status.baud = 4800;
     mouse_status.mode = 'D';
 
-    add_alarm_in_ms(1000, mouse_selftest_callback, NULL, false);
+    // Forget anything queued while the other personality was active
+    mouse_packet_drain();
+    mouse_status.dx = 0;
+    mouse_status.dy = 0;
+    ballistics_reset();
+
+    mouse_stream_start(18000);
+    if(announce) {
+        // Replacing the other personality, show the host a fresh device
+        stream_break();
+        mouse_selftest();
+    } else {
+        mouse_alarm = alarm_pool_add_alarm_in_ms(stream_alarm_pool, 1000, mouse_selftest_callback, NULL, false);
+    }
+}
+
+static void mouse_stop() {
+    cancel_repeating_timer(&mouse_status.timer);
+    ballistics_reset();
+    if(mouse_alarm > 0)
+        alarm_pool_cancel_alarm(stream_alarm_pool, mouse_alarm);
+    mouse_alarm = 0;
+    mouse_status.selftest_done = false;
+}
 
-    add_repeating_timer_ms(-18, mouse_stream_callback, NULL, &mouse_status.timer);
-}
\ No newline at end of file
+const stream_engine_t mouse_engine = { mouse_start, mouse_stop, mouse_dowork };
\ No newline at end of file
@@ -2,33 +2,53 @@
 #define __MOUSE_H
 
 typedef struct mouse_packet_s {
-    int8_t x;
-    int8_t y;
+    int16_t x;
+    int16_t y;
 
     uint8_t buttons;
+
+    uint32_t time;              // USB arrival, time_us_32()
 } mouse_packet_t;
 
-uint8_t mp_wrptr;
-uint8_t mp_rdptr;
+// USB reports queued for the serial side, must be a power of two
+#define MOUSE_QUEUE (256)
+
+// Sample-to-wire age of stream reports, 1ms per bucket, the last is open ended
+#define MOUSE_AGE_BUCKETS (16)
 
 typedef struct mouse_status_s {
     bool selftest_done;
 
-    uint8_t buttons;
+    uint8_t buttons;            // Latest USB button state
+    uint8_t buttons_pressed;    // Edges not yet seen by the host
+    uint8_t buttons_released;
 
     uint8_t laststate;
 
     int16_t dx;
     int16_t dy;
     
+    uint32_t sample_time;       // Arrival of the newest sample integrated
+    bool sample_fresh;          // ... and not yet reported
+
     uint16_t baud;
     uint8_t mode;
 
+    // Stream timing, all on core1: the timer callback reads and advances
+    // these, everything else only changes them with the timer cancelled
+    uint32_t period_us;         // Stream interval selected by the host
+    uint64_t next_report;       // Nominal time of the next stream report
+    volatile bool report_due;   // Set by the stream timer, cleared by mouse_dowork()
+
     struct repeating_timer timer;
 } mouse_status_t;
 
-extern void mouse_init();
-extern void mouse_dowork();
-extern void mouse_packet_enqueue(int8_t x, int8_t y, uint8_t buttons);
+extern const stream_engine_t mouse_engine;
+extern void mouse_packet_enqueue(int16_t x, int16_t y, uint8_t buttons);
+extern void mouse_packet_flush();
+
+extern uint32_t mp_merges;
+extern uint32_t mp_button_merges;
+extern uint32_t mouse_age_hist[MOUSE_AGE_BUCKETS];
 
 #endif /* __MOUSE_H */
\ No newline at end of file
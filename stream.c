@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <pico/stdlib.h>
+#include <hardware/dma.h>
+#include <hardware/timer.h>
+#include <hardware/uart.h>
+
+#include "stream.h"
+
+// Packets to the host go out on uart1 one at a time: a new packet is only
+// built once the previous one has left the wire, so it always carries the
+// freshest state instead of waiting behind stale ones in the UART FIFO.
+//
+// Frames are handed to a DMA channel paced by the UART TX DREQ. A second
+// buffer lets a frame queue behind the one in flight, e.g. a self test
+// report behind a BREAK. Baud rate changes and BREAKs are applied by
+// stream_pump() once the frames before them have left the wire.
+
+typedef struct stream_frame_s {
+    uint8_t data[STREAM_FRAME_MAX];
+    uint8_t len;
+    uint baud;                          // Line rate the frame goes out at
+    uint64_t queued;                    // us since boot
+} stream_frame_t;
+
+// Stream timers run from this pool so they fire on core1, with the code
+// they share state with, rather than on core0 like the default pool
+alarm_pool_t *stream_alarm_pool;
+
+static const stream_engine_t *stream_active;
+static const stream_engine_t * volatile stream_requested;
+
+static stream_frame_t stream_frames[2];
+static int stream_inflight = -1;        // Frame being sent by DMA
+static int stream_next = -1;            // Frame waiting for the line
+static uint stream_dma;
+
+static uint stream_baud = 4800;         // For frames queued from now on
+static uint stream_line_baud = 4800;    // Programmed into the UART
+static bool stream_break_pending;
+static uint64_t stream_break_end;       // 0 when not in BREAK
+
+static uint64_t stream_window;          // Start of the current 1s window
+static uint32_t stream_window_packets;
+static uint64_t stream_window_busy;     // Wire time used in the window
+
+uint32_t stream_packets;                // Packets sent since boot
+uint32_t stream_pps;                    // Packets in the last full second
+uint32_t stream_line_pct;               // Line utilisation in the last second
+uint32_t stream_delay_max_us;           // Worst time a packet sat behind another
+uint32_t stream_overwrites;             // Waiting frames replaced by newer ones
+
+// Called on core1, which then owns uart1. engine is used unless the USB
+// side has already asked for another one.
+void stream_init(const stream_engine_t *engine) {
+    dma_channel_config c;
+
+    // Its IRQ goes to the core creating it, this one
+    stream_alarm_pool = alarm_pool_create_with_unused_hardware_alarm(STREAM_TIMERS);
+
+    uart_init(uart1, 4800);
+    uart_set_format(uart1, 8, 1, UART_PARITY_ODD);
+    gpio_set_function(8, GPIO_FUNC_UART);
+    gpio_set_function(9, GPIO_FUNC_UART);
+
+    stream_dma = dma_claim_unused_channel(true);
+    c = dma_channel_get_default_config(stream_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, uart_get_dreq(uart1, true));
+    dma_channel_configure(stream_dma, &c, &uart_get_hw(uart1)->dr, NULL, 0, false);
+
+    if(!stream_requested)
+        stream_requested = engine;
+
+    stream_active = stream_requested;
+    stream_active->start(false);
+}
+
+// Called from the USB side (core0) when a device needing the other
+// personality is plugged in, the swap happens on core1.
+void stream_select(const stream_engine_t *engine) {
+    stream_requested = engine;
+}
+
+static inline bool stream_line_idle() {
+    return !dma_channel_is_busy(stream_dma) && !(uart_get_hw(uart1)->fr & UART_UARTFR_BUSY_BITS);
+}
+
+static void stream_start(stream_frame_t *frame) {
+    uint64_t now = time_us_64();
+    uint32_t wire = (frame->len * STREAM_FRAME_BITS * 1000000) / frame->baud;
+
+    if(now - stream_window >= 1000000) {
+        stream_pps = stream_window_packets;
+        stream_line_pct = (stream_window_busy * 100) / (now - stream_window);
+        stream_window = now;
+        stream_window_packets = 0;
+        stream_window_busy = 0;
+    }
+
+    if(now - frame->queued > stream_delay_max_us)
+        stream_delay_max_us = now - frame->queued;
+
+    dma_channel_transfer_from_buffer_now(stream_dma, frame->data, frame->len);
+
+    stream_packets++;
+    stream_window_packets++;
+    stream_window_busy += wire;
+}
+
+// Move the line along: end a BREAK, then apply a BREAK or baud change once
+// the line is idle, then start the waiting frame. Never blocks.
+static void stream_pump() {
+    stream_frame_t *frame;
+    uint baud;
+
+    if(stream_inflight >= 0) {
+        if(dma_channel_is_busy(stream_dma))
+            return;
+        stream_inflight = -1;
+    }
+
+    if(stream_break_end) {
+        if(time_us_64() < stream_break_end)
+            return;
+        uart_set_break(uart1, false);
+        stream_break_end = 0;
+    }
+
+    frame = (stream_next >= 0) ? &stream_frames[stream_next] : NULL;
+    baud = frame ? frame->baud : stream_baud;
+
+    if(stream_break_pending || (baud != stream_line_baud)) {
+        // The FIFO has to drain at the old rate first
+        if(!stream_line_idle())
+            return;
+
+        if(baud != stream_line_baud) {
+            uart_set_baudrate(uart1, baud);
+            stream_line_baud = baud;
+        }
+
+        if(stream_break_pending) {
+            stream_break_pending = false;
+            uart_set_break(uart1, true);
+            stream_break_end = time_us_64() + STREAM_BREAK_MS * 1000;
+            return;
+        }
+    }
+
+    if(frame) {
+        stream_start(frame);
+        stream_inflight = stream_next;
+        stream_next = -1;
+    }
+}
+
+void stream_dowork() {
+    const stream_engine_t *engine = stream_requested;
+
+    if(engine != stream_active) {
+        stream_active->stop();
+        stream_active = engine;
+        stream_active->start(true);
+    }
+
+    stream_pump();
+    stream_active->dowork();
+}
+
+// Hold our TX line in BREAK so the host notices the device went away,
+// frames sent after this wait for it to end
+void stream_break() {
+    stream_break_pending = true;
+    stream_pump();
+}
+
+// Takes effect for frames sent after this, once those before have gone
+void stream_set_baud(uint baud) {
+    stream_baud = baud;
+    stream_pump();
+}
+
+bool stream_ready() {
+    stream_pump();
+
+    if((stream_inflight >= 0) || (stream_next >= 0) || stream_break_pending || stream_break_end)
+        return false;
+
+    return !(uart_get_hw(uart1)->fr & UART_UARTFR_BUSY_BITS);
+}
+
+void stream_send(const uint8_t *packet, uint len) {
+    stream_frame_t *frame;
+    uint i;
+
+    if(len > STREAM_FRAME_MAX)
+        len = STREAM_FRAME_MAX;
+
+    if(stream_next >= 0) {
+        // Both buffers taken, the newer frame replaces the waiting one
+        stream_overwrites++;
+    } else {
+        stream_next = (stream_inflight == 0) ? 1 : 0;
+    }
+
+    frame = &stream_frames[stream_next];
+    for(i = 0; i < len; i++)
+        frame->data[i] = packet[i];
+    frame->len = len;
+    frame->baud = stream_baud;
+    frame->queued = time_us_64();
+
+    stream_pump();
+}
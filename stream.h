@@ -0,0 +1,39 @@
+#ifndef __STREAM_H
+#define __STREAM_H
+
+// Bits per byte on the DEC serial lines: start, 8 data, odd parity, stop
+#define STREAM_FRAME_BITS (11)
+
+// Longest packet, the tablet's is five bytes
+#define STREAM_FRAME_MAX (8)
+
+// How long a BREAK is held on our TX line to announce a device change
+#define STREAM_BREAK_MS (10)
+
+// Timers and alarms the personalities can have running at once
+#define STREAM_TIMERS (4)
+
+// A DEC device personality on uart1, only the active one runs
+typedef struct stream_engine_s {
+    void (*start)(bool announce);   // Reset, then self test now or after power up
+    void (*stop)();                 // Cancel timers and alarms
+    void (*dowork)();
+} stream_engine_t;
+
+extern alarm_pool_t *stream_alarm_pool;
+
+extern void stream_init(const stream_engine_t *engine);
+extern void stream_select(const stream_engine_t *engine);
+extern void stream_dowork();
+extern void stream_break();
+extern void stream_set_baud(uint baud);
+extern bool stream_ready();
+extern void stream_send(const uint8_t *packet, uint len);
+
+extern uint32_t stream_packets;
+extern uint32_t stream_pps;
+extern uint32_t stream_line_pct;
+extern uint32_t stream_delay_max_us;
+extern uint32_t stream_overwrites;
+
+#endif /* __STREAM_H */
\ No newline at end of file
@@ -1,10 +1,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <pico/stdlib.h>
+#include <hardware/sync.h>
+
+#include "stream.h"
+#include "tablet.h"
 
 typedef struct tablet_status_s {
     bool selftest_done;
 
+    uint8_t buttons;            // Latest USB button state
     uint8_t buttons_held;
     uint8_t buttons_pressed;
     uint8_t buttons_released;
@@ -18,9 +23,119 @@ typedef struct tablet_status_s {
     uint8_t mode;
 
     struct repeating_timer timer;
+    volatile bool report_due;   // Set by the stream timer, cleared by tablet_dowork()
 } tablet_status_t;
 
 tablet_status_t tablet_status;
+static alarm_id_t tablet_alarm;         // Power up self test
+
+// Single producer (USB, core0), single consumer (core1). Positions are
+// absolute, so a sample lost to a full queue only loses its button edges.
+static uint32_t tablet_samples[TABLET_QUEUE];
+static volatile uint32_t tablet_wrptr;
+static volatile uint32_t tablet_rdptr;
+
+uint32_t tablet_drops;                  // Samples lost to a full queue
+
+// Samples are packed as X, Y and buttons, with a flag for positions that
+// need no jitter filtering
+#define TABLET_SAMPLE_EXACT (1u << 28)
+
+// False when the queue is full and the sample was dropped
+static bool tablet_queue(uint32_t sample) {
+    uint32_t next = tablet_wrptr + 1;
+
+    if((next & (TABLET_QUEUE - 1)) == (tablet_rdptr & (TABLET_QUEUE - 1))) {
+        tablet_drops++;
+        return false;
+    }
+
+    tablet_samples[tablet_wrptr & (TABLET_QUEUE - 1)] = sample;
+    __dmb();
+    tablet_wrptr = next;
+    return true;
+}
+
+void tablet_sample(uint16_t x, uint16_t y, uint8_t buttons) {
+    tablet_queue((x & 0xFFF) | ((y & 0xFFF) << 12) | ((buttons & 0xF) << 24));
+}
+
+// Relative emulation, integrated on the USB side (core0) in 20.8 fixed
+// point so motion below one tablet count is carried, not lost.
+#define TABLET_REL_SPAN ((TABLET_MAX + 1) << 8)
+
+static int32_t tablet_rel_x = TABLET_REL_SPAN / 2;
+static int32_t tablet_rel_y = TABLET_REL_SPAN / 2;
+static uint32_t tablet_rel_last = 0xFFFFFFFF;   // Last sample that made it into the queue
+
+static int32_t tablet_rel_axis(int32_t pos, int32_t delta) {
+    pos += delta * TABLET_REL_GAIN;
+
+    if(TABLET_REL_EDGE == TABLET_EDGE_WRAP) {
+        pos %= TABLET_REL_SPAN;
+        if(pos < 0)
+            pos += TABLET_REL_SPAN;
+    } else if(pos < 0) {
+        pos = 0;
+    } else if(pos >= TABLET_REL_SPAN) {
+        pos = TABLET_REL_SPAN - 1;
+    }
+
+    return pos;
+}
+
+void tablet_move(int16_t dx, int16_t dy, uint8_t buttons) {
+    uint16_t x, y;
+    uint32_t key;
+
+    // Mice count Y down the screen, the tablet up
+    tablet_rel_x = tablet_rel_axis(tablet_rel_x, dx);
+    tablet_rel_y = tablet_rel_axis(tablet_rel_y, -dy);
+    x = tablet_rel_x >> 8;
+    y = tablet_rel_y >> 8;
+
+    // Only queue what could change a packet: 0xFFE of the position, or the buttons
+    key = (x & 0xFFE) | ((y & 0xFFE) << 12) | ((buttons & 0xF) << 24);
+    if(key == tablet_rel_last)
+        return;
+
+    // A dropped sample is retried with the next report, so a button edge
+    // lost to a full queue is still seen
+    if(tablet_queue(x | (y << 12) | ((buttons & 0xF) << 24) | TABLET_SAMPLE_EXACT))
+        tablet_rel_last = key;
+}
+
+// Only move by more than the dead-band, so a resting pen does not send
+static inline uint16_t tablet_filter(uint16_t cur, uint16_t raw) {
+    if((raw > cur + TABLET_JITTER) || (raw + TABLET_JITTER < cur))
+        return raw;
+    return cur;
+}
+
+static void tablet_drain() {
+    uint32_t sample;
+    uint8_t buttons;
+
+    while(tablet_rdptr != tablet_wrptr) {
+        __dmb();
+        sample = tablet_samples[tablet_rdptr & (TABLET_QUEUE - 1)];
+        __dmb();
+        tablet_rdptr++;
+
+        if(sample & TABLET_SAMPLE_EXACT) {
+            tablet_status.x = sample & 0xFFF;
+            tablet_status.y = (sample >> 12) & 0xFFF;
+        } else {
+            tablet_status.x = tablet_filter(tablet_status.x, sample & 0xFFF);
+            tablet_status.y = tablet_filter(tablet_status.y, (sample >> 12) & 0xFFF);
+        }
+
+        buttons = (sample >> 24) & 0xF;
+        tablet_status.buttons_pressed |= buttons & ~tablet_status.buttons;
+        tablet_status.buttons_released |= tablet_status.buttons & ~buttons;
+        tablet_status.buttons = buttons;
+    }
+}
 
 static void tablet_report() {
     uint8_t ts = 0x40;
@@ -46,20 +161,29 @@ static void tablet_report() {
         ts |= 0x80;
     
     tablet_status.laststate = ts;
+    if(ts & 0x80) {
+        tablet_status.lx = tablet_status.x;
+        tablet_status.ly = tablet_status.y;
+    }
 
     if(ts & 0x80) {
         // DEC Serial Tablet Packet
-        uart_putc_raw(uart1, ts);
-        uart_putc_raw(uart1, tablet_status.x & 0x3f);
-        uart_putc_raw(uart1, (tablet_status.x >> 6) & 0x3f);
-        uart_putc_raw(uart1, tablet_status.y & 0x3f);
-        uart_putc_raw(uart1, (tablet_status.y >> 6) & 0x3f);
+        uint8_t packet[5] = {
+            ts,
+            tablet_status.x & 0x3f,
+            (tablet_status.x >> 6) & 0x3f,
+            tablet_status.y & 0x3f,
+            (tablet_status.y >> 6) & 0x3f,
+        };
+        stream_send(packet, sizeof(packet));
     }
 }
 
+// Only marks a report as due, tablet_dowork() builds and sends it so a
+// packet is never interleaved with another on the wire.
 static bool tablet_stream_callback(struct repeating_timer *t) {
     if(tablet_status.selftest_done && (tablet_status.mode == 'R'))
-        tablet_report();
+        tablet_status.report_due = true;
 
     return true;
 }
@@ -68,24 +192,26 @@ static void tablet_set_reportrate(uint rate) {
     cancel_repeating_timer(&tablet_status.timer);
 
     if(rate == 120) {
-        add_repeating_timer_ms(-9, tablet_stream_callback, NULL, &tablet_status.timer);
+        alarm_pool_add_repeating_timer_ms(stream_alarm_pool, -9, tablet_stream_callback, NULL, &tablet_status.timer);
     } else if(rate == 72) {
-        add_repeating_timer_ms(-14, tablet_stream_callback, NULL, &tablet_status.timer);
+        alarm_pool_add_repeating_timer_ms(stream_alarm_pool, -14, tablet_stream_callback, NULL, &tablet_status.timer);
     } else {
-        add_repeating_timer_ms(-18, tablet_stream_callback, NULL, &tablet_status.timer);
+        alarm_pool_add_repeating_timer_ms(stream_alarm_pool, -18, tablet_stream_callback, NULL, &tablet_status.timer);
     }
 }
 
 static void tablet_selftest() {
-    uart_tx_wait_blocking(uart1);
-    uart_set_baudrate(uart1, 4800);
-
-    uart_putc_raw(uart1, 0xA0);  // Self Test Report, REV0
-    uart_putc_raw(uart1, 0x04);  // Manufacturing ID 0, Tablet
-    uart_putc_raw(uart1, 0x00);  // No Errors
-    uart_putc_raw(uart1, 0x00);  // No Buttons Held
+    uint8_t report[4] = {
+        0xA0,   // Self Test Report, REV0
+        0x04,   // Manufacturing ID 0, Tablet
+        0x00,   // No Errors
+        0x00,   // No Buttons Held
+    };
 
+    // Goes out at 4800 baud once anything still queued has been sent
     tablet_status.baud = 4800;
+    stream_set_baud(4800);
+    stream_send(report, sizeof(report));
     tablet_status.mode = 'D';
     tablet_status.lx = 0;
     tablet_status.ly = 0;
@@ -95,6 +221,7 @@ static void tablet_selftest() {
     tablet_status.buttons_released = 0;
     tablet_status.buttons_pressed = 0;
     tablet_status.buttons_held = 0;
+    tablet_status.buttons = 0;
 
     tablet_set_reportrate(55);
 
@@ -106,12 +233,14 @@ static void tablet_selftest() {
     tablet_status.selftest_done = true;
 }
 
+// Power up self test, run from tablet_dowork() like one the host asks for
 static int64_t tablet_selftest_callback(alarm_id_t id, void *user_data) {
-    tablet_selftest();
+    tablet_alarm = 0;
+    tablet_status.mode = 'T';
     return 0;
 }
 
-void tablet_dowork() {
+static void tablet_dowork() {
     if(uart_get_hw(uart1)->rsr & UART_UARTRSR_BE_BITS) {
         // Serial BREAK condition
         hw_clear_bits(&uart_get_hw(uart1)->rsr, UART_UARTRSR_BITS);
@@ -125,8 +254,7 @@ void tablet_dowork() {
             case 'B':
                 // Change baud rate to 9600
                 tablet_status.baud = 9600;
-                uart_tx_wait_blocking(uart1);
-                uart_set_baudrate(uart1, 9600);
+                stream_set_baud(9600);
                 break;
             case 'S':
                 // Stream Report Format
@@ -168,14 +296,24 @@ void tablet_dowork() {
         }
     }
     
-    if(!tablet_status.selftest_done) {
+    if(!tablet_status.selftest_done && (tablet_status.mode != 'T')) {
         return;
     }
 
+    tablet_drain();
+
     switch(tablet_status.mode) {
     case 'P':
-        tablet_report();
-        tablet_status.mode = 'D';
+        if(stream_ready()) {
+            tablet_report();
+            tablet_status.mode = 'D';
+        }
+        break;
+    case 'R':
+        if(tablet_status.report_due && stream_ready()) {
+            tablet_status.report_due = false;
+            tablet_report();
+        }
         break;
     case 'T':
         tablet_selftest();
@@ -183,17 +321,30 @@ void tablet_dowork() {
     }
 }
 
-void tablet_init() {
-    uart_init(uart1, 4800);
-    uart_set_format(uart1, 8, 1, UART_PARITY_ODD);
-    gpio_set_function(8, GPIO_FUNC_UART);
-    gpio_set_function(9, GPIO_FUNC_UART);
-    
+static void tablet_start(bool announce) {
     memset(&tablet_status, 0, sizeof(tablet_status));
     tablet_status.baud = 4800;
     tablet_status.mode = 'D';
 
-    add_alarm_in_ms(1000, tablet_selftest_callback, NULL, false);
+    // Forget anything queued while the other personality was active
+    tablet_drain();
+
+    alarm_pool_add_repeating_timer_ms(stream_alarm_pool, -18, tablet_stream_callback, NULL, &tablet_status.timer);
+    if(announce) {
+        // Replacing the other personality, show the host a fresh device
+        stream_break();
+        tablet_selftest();
+    } else {
+        tablet_alarm = alarm_pool_add_alarm_in_ms(stream_alarm_pool, 1000, tablet_selftest_callback, NULL, false);
+    }
+}
+
+static void tablet_stop() {
+    cancel_repeating_timer(&tablet_status.timer);
+    if(tablet_alarm > 0)
+        alarm_pool_cancel_alarm(stream_alarm_pool, tablet_alarm);
+    tablet_alarm = 0;
+    tablet_status.selftest_done = false;
+}
 
-    add_repeating_timer_ms(-18, tablet_stream_callback, NULL, &tablet_status.timer);
-}
\ No newline at end of file
+const stream_engine_t tablet_engine = { tablet_start, tablet_stop, tablet_dowork };
\ No newline at end of file
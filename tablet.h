@@ -1,7 +1,31 @@
 #ifndef __TABLET_H
 #define __TABLET_H
 
-extern void tablet_init();
-extern void tablet_dowork();
+// Full scale of tablet coordinates, and the movement ignored as digitizer noise
+#define TABLET_MAX      (4095)
+#define TABLET_JITTER   (2)
+
+// Absolute samples queued from USB, must be a power of two
+#define TABLET_QUEUE    (32)
+
+// Relative mice driving the tablet instead of the mouse, the gain is 8.8
+// fixed point tablet counts per mouse count
+#ifndef TABLET_EMULATION
+#define TABLET_EMULATION    (0)
+#endif
+#ifndef TABLET_REL_GAIN
+#define TABLET_REL_GAIN     (512)
+#endif
+#ifndef TABLET_REL_EDGE
+#define TABLET_REL_EDGE     TABLET_EDGE_CLAMP
+#endif
+#define TABLET_EDGE_CLAMP   (0)     // Stop at the edge of the tablet
+#define TABLET_EDGE_WRAP    (1)     // Come back in on the opposite side
+
+extern const stream_engine_t tablet_engine;
+extern void tablet_sample(uint16_t x, uint16_t y, uint8_t buttons);
+extern void tablet_move(int16_t dx, int16_t dy, uint8_t buttons);
+
+extern uint32_t tablet_drops;
 
 #endif /* __TABLET_H */
\ No newline at end of file
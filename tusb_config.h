@@ -95,14 +95,14 @@
 // Size of buffer to hold descriptors and other data used for enumeration
 #define CFG_TUH_ENUMERATION_BUFSIZE 256
 
-#define CFG_TUH_HUB                 1 // number of supported hubs
+#define CFG_TUH_HUB                 2 // number of supported hubs, a KVM or keyboard hub behind a desk hub
 #define CFG_TUH_CDC                 1
-#define CFG_TUH_HID                 4 // typical keyboard + mouse device can have 3-4 HID interfaces
+#define CFG_TUH_HID                 16 // HID interfaces over all devices, combo receivers and KVMs have 3-4 each
 #define CFG_TUH_MSC                 0
 #define CFG_TUH_VENDOR              0
 
 // max device support (excluding hub device)
-#define CFG_TUH_DEVICE_MAX          (CFG_TUH_HUB ? 4 : 1) // hub typically has 4 ports
+#define CFG_TUH_DEVICE_MAX          (CFG_TUH_HUB ? 8 : 1) // the ports of two typical 4 port hubs, one per CFG_TUH_HUB
 
 //------------- HID -------------//
 #define CFG_TUH_HID_EPIN_BUFSIZE    64